@@ -28,17 +28,31 @@ namespace OpenEngine {
         namespace OpenGL {
             
             using namespace OpenEngine::Scene;
+
+            // The reflection mirrors the scene in y = 1 and clips
+            // what ends up above y = 0, that is the scene below y = 2.
+            static const float MIRROR_HEIGHT = 1.0f;
+            static const float CLIP_HEIGHT = 2.0f * MIRROR_HEIGHT;
             
             TerrainRenderingView::TerrainRenderingView()
-                : RenderingView() {
+                : RenderingView(), reflectionPass(false), 
+                  reflectionLODBias(1.0f), reflectionHeight(0) {
 
                 lightDir = Vector<3, float>(1,1,1).GetNormalize();
             }
 
             void TerrainRenderingView::VisitGrassNode(GrassNode* node) {
+                // Grass is too small to notice in a reflection.
+                if (reflectionPass){
+                    node->VisitSubNodes(*this);
+                    return;
+                }
+
                 if (currentRenderState->IsOptionDisabled(RenderStateNode::BACKFACE))
                     glDisable(GL_CULL_FACE);
 
+                node->CalcCells(arg->canvas.GetViewingVolume());
+
                 GeometrySetPtr geom = node->GetGrassGeometry();
                 this->ApplyGeometrySet(geom);
                 
@@ -47,22 +61,28 @@ namespace OpenEngine {
                     shader->SetUniform("lightDir", lightDir);
                     shader->SetUniform("time", node->GetElapsedTime() / 1000000.0f);
 
-                    // Move the view position by the grid dimension
-                    // relative to the eye direction.
-                    Vector<3, float> eyeDir = arg->canvas.GetViewingVolume()->GetDirection().RotateVector(Vector<3, float>(0,0,1));
                     Vector<3, float> viewPos = arg->canvas.GetViewingVolume()->GetPosition();
-                    Vector<2, float> eyePos(viewPos.Get(0), viewPos.Get(2));
-                    shader->SetUniform("viewPos", eyePos);
-                    int halfDim = node->GetGridDimension() / 2;
-                    eyePos[0] -= eyeDir.Get(0) * halfDim;
-                    eyePos[1] -= eyeDir.Get(2) * halfDim;
-                    shader->SetUniform("patchCenter", eyePos);
+                    shader->SetUniform("viewPos", Vector<2, float>(viewPos.Get(0), viewPos.Get(2)));
+                    shader->SetUniform("patchCenter", node->GetPatchCenter());
 
                     shader->ApplyShader();
                 }else
                     glColor3f(0,1,0);
                 
-                glDrawArrays(GL_QUADS, 0, geom->GetVertices()->GetSize());
+                // Draw the visible cells, each thinned to the straws
+                // of highest priority.
+                const std::vector<GrassNode::CellDraw>& draws = node->GetCellDraws();
+                if (node->IsInstanced()){
+                    unsigned int strawSize = geom->GetVertices()->GetSize();
+                    for (unsigned int i = 0; i < draws.size(); ++i){
+                        if (shader) shader->SetUniform("instanceOffset", float(draws[i].first));
+                        glDrawArraysInstancedARB(GL_QUADS, 0, strawSize, draws[i].count);
+                    }
+                }else{
+                    unsigned int strawSize = 4 * node->GetQuadsPrObject();
+                    for (unsigned int i = 0; i < draws.size(); ++i)
+                        glDrawArrays(GL_QUADS, draws[i].first * strawSize, draws[i].count * strawSize);
+                }
 
                 if (shader){
                     shader->ReleaseShader();
@@ -76,6 +96,13 @@ namespace OpenEngine {
             }
             
             void TerrainRenderingView::VisitHeightMapNode(HeightMapNode* node) {
+                if (!node->UpdateLoad(*arg)){
+                    // Still loading in the background
+                    node->RenderPlaceholder(*arg);
+                    node->VisitSubNodes(*this);
+                    return;
+                }
+
                 bool bufferSupport = arg->renderer.BufferSupport();
                 
                 GeometrySetPtr geom = node->GetGeometrySet();
@@ -90,13 +117,25 @@ namespace OpenEngine {
                     shader->ApplyShader();
                 }
 
-                node->CalcLOD(arg->canvas.GetViewingVolume());
+                // The reflection keeps its own LODs, culled against
+                // the mirrored view.
+                HeightMapLODState* reflection = NULL;
+                if (reflectionPass){
+                    reflection = &reflectionStates[node];
+                    reflection->SetReflection(true, MIRROR_HEIGHT, CLIP_HEIGHT);
+                    reflection->SetLODBias(reflectionLODBias);
+                    node->CalcLOD(arg->canvas.GetViewingVolume(), *reflection, reflectionHeight);
+                }else
+                    node->CalcLOD(arg->canvas.GetViewingVolume(), arg->canvas.GetHeight());
                 
                 IndicesPtr indices = node->GetIndices();
                 if (bufferSupport) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices->GetID());
 
                 // Replace with a patch iterator
-                node->Render(*arg);
+                if (reflection != NULL)
+                    node->Render(*arg, *reflection);
+                else
+                    node->Render(*arg);
 
                 if (shader){
                     shader->ReleaseShader();
@@ -105,7 +144,7 @@ namespace OpenEngine {
                 
                 if (bufferSupport) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-                if (renderTangent)
+                if (renderTangent && !reflectionPass)
                     node->RenderBoundingGeometry();
 
                 node->VisitSubNodes(*this);
@@ -158,45 +197,53 @@ namespace OpenEngine {
             void TerrainRenderingView::VisitWaterNode(WaterNode* node) {
                 IShaderResourcePtr shader = node->GetWaterShader();
                 if (shader != NULL){
-                    FrameBuffer* reflection = node->GetReflectionFbo();
-                    Vector<2, int> refDim = reflection->GetDimension();
-
-                    // setup water clipping plane
-                    double plane[4] = {0.0, -1.0, 0.0, 0.0}; //water at y~~0
-                    glEnable(GL_CLIP_PLANE0);
-                    glClipPlane(GL_CLIP_PLANE0, plane);
+                    // The reflection is only rendered when the water's
+                    // update policy asks for it, otherwise the last
+                    // rendering is reused.
+                    if (node->UpdateReflection(*arg)){
+                        FrameBuffer* reflection = node->GetReflectionFbo();
+                        Vector<2, int> refDim = reflection->GetDimension();
+
+                        // setup water clipping plane
+                        double plane[4] = {0.0, -1.0, 0.0, 0.0}; //water at y~~0
+                        glEnable(GL_CLIP_PLANE0);
+                        glClipPlane(GL_CLIP_PLANE0, plane);
                     
-                    glViewport(0, 0, refDim[0], refDim[1]);
+                        glViewport(0, 0, refDim[0], refDim[1]);
 
-                    // store previous frame buffer
-                    GLint prevFbo;
-                    glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &prevFbo);
+                        // store previous frame buffer
+                        GLint prevFbo;
+                        glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &prevFbo);
                     
-                    // Render reflection
+                        // Render reflection
                     
-                    // Enable frame buffer
-                    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, reflection->GetID());
-                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                        // Enable frame buffer
+                        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, reflection->GetID());
+                        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
                     
-                    glCullFace(GL_FRONT);
+                        glCullFace(GL_FRONT);
                     
-                    glPushMatrix();
+                        glPushMatrix();
 
-                    glScalef(1, -1, 1);
-                    glTranslatef(0, -2, 0);
+                        glScalef(1, -1, 1);
+                        glTranslatef(0, -2 * MIRROR_HEIGHT, 0);
                     
-                    // Render scene
-                    node->VisitSubNodes(*this);
+                        // Render scene
+                        reflectionPass = true;
+                        reflectionHeight = refDim[1];
+                        node->VisitSubNodes(*this);
+                        reflectionPass = false;
                     
-                    glPopMatrix();
-                    glCullFace(GL_BACK);
+                        glPopMatrix();
+                        glCullFace(GL_BACK);
 
-                    // Restore the previous frame buffer
-                    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, prevFbo);
-                    glDisable(GL_CLIP_PLANE0);
+                        // Restore the previous frame buffer
+                        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, prevFbo);
+                        glDisable(GL_CLIP_PLANE0);
                     
-                    // Reset viewport
-                    glViewport(0, 0, arg->canvas.GetWidth(), arg->canvas.GetHeight());
+                        // Reset viewport
+                        glViewport(0, 0, arg->canvas.GetWidth(), arg->canvas.GetHeight());
+                    }
                     
                     // Render reflection
                     node->VisitSubNodes(*this);
@@ -276,7 +323,9 @@ namespace OpenEngine {
                 Vector<3, float> viewPos = arg->canvas.GetViewingVolume()->GetPosition();
                 atm->SetUniform("v3CameraPos", viewPos);
                 atm->SetUniform("fCameraHeight", viewPos.Get(1));
-                atm->SetUniform("v3LightPos", Vector<3, float>(-1,0.3,0).GetNormalize()); // should be normalized
+                Vector<3, float> sunDir = node->GetSunDirection();
+                atm->SetUniform("v3LightPos", sunDir);
+                node->UpdateScattering(sunDir);
 
                 this->ApplyMesh(node->GetMesh().get());
             }
@@ -19,6 +19,8 @@
 #include <Scene/SunNode.h>
 #include <Scene/SkySphereNode.h>
 
+#include <map>
+
 namespace OpenEngine {
 namespace Renderers {
 namespace OpenGL {
@@ -28,9 +30,23 @@ using namespace OpenEngine::Renderers;
  class TerrainRenderingView : public RenderingView {
  protected:
      Vector<3, float> lightDir;
+
+     // Water reflections are rendered with coarser terrain and
+     // without grass.
+     bool reflectionPass;
+     float reflectionLODBias;
+     unsigned int reflectionHeight;
+     std::map<HeightMapNode*, HeightMapLODState> reflectionStates;
      
  public:
      TerrainRenderingView();
+
+     /**
+      * How many LODs coarser the terrain is in water reflections,
+      * see HeightMapLODState::SetLODBias.
+      */
+     void SetReflectionLODBias(const float bias) { reflectionLODBias = bias; }
+     float GetReflectionLODBias() const { return reflectionLODBias; }
      
      void VisitGrassNode(GrassNode* node);
      void VisitHeightMapNode(HeightMapNode* node);
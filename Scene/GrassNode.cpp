@@ -17,61 +17,235 @@
 #include <Math/RandomGenerator.h>
 
 #include <Scene/HeightMapNode.h>
+#include <Meta/OpenGL.h>
+#include <Display/IViewingVolume.h>
+#include <Geometry/Box.h>
 
 #include <list>
+#include <algorithm>
 using std::list;
+using std::vector;
 
 #include <Logging/Logger.h>
 
 using namespace OpenEngine::Geometry;
 using namespace OpenEngine::Resources;
+using namespace OpenEngine::Display;
 
 namespace OpenEngine {
     namespace Scene {
 
+        static const float STRAW_WIDTH = 3;
+        static const float STRAW_HEIGHT = 3;
+        static const unsigned int INSTANCE_DATA_WIDTH = 256;
+        static const float MAX_STRAW_SCALE = 1.2f;
+        static const float PRIORITY_LEVELS = 256.0f;
+        // Poisson disk placement, the fraction of the area a straw
+        // may claim and the darts thrown per straw.
+        static const float POISSON_PACKING = 0.4f;
+        static const int POISSON_ATTEMPTS = 30;
+        static const int MAX_TILES_PR_SIDE = 16;
+
         GrassNode::GrassNode() {
             quadsPrObject = 3;
+            cellsPrSide = 1;
+            instanced = false;
             grassShader.reset();
             heightmap = NULL;
+            initialized = heightmapReady = false;
             gridDim = straws = 0;
             elapsedTime = 0;
+            seed = usedSeed = 0;
+            terrainMask = false;
+            SetDensityLOD(0.0f, 0.0f, 1.0f);
+            drawnStraws = 0;
+            CreateStraws();
             grassGeom = CreateGrassObject();
         }
 
         GrassNode::GrassNode(HeightMapNode* heightmap, IShaderResourcePtr shader, 
-                             int straws, int gridDimension, int quadsPrObject) 
+                             int straws, int gridDimension, int quadsPrObject,
+                             int cellsPrSide) 
             : grassShader(shader),
               heightmap(heightmap),
+              initialized(false),
+              heightmapReady(false),
               gridDim(gridDimension),
               straws(straws),
-              quadsPrObject(quadsPrObject) {
+              quadsPrObject(quadsPrObject),
+              seed(0),
+              cellsPrSide(cellsPrSide < 1 ? 1 : cellsPrSide),
+              drawnStraws(0),
+              instanced(false),
+              terrainMask(false),
+              elapsedTime(0) {
 
+            SetDensityLOD(gridDim / 4.0f, gridDim / 2.0f, 0.25f);
+            CreateStraws();
             grassGeom = CreateGrassObject();
+
+            if (heightmap)
+                heightmap->LoadedEvent().Attach(*this);
         }
-        
-        void GrassNode::Handle(RenderingEventArg arg){
-            if (grassShader){
-                float widthScale = heightmap->GetWidthScale();
 
-                ITexture2DPtr tex = heightmap->GetHeightMap();
-                grassShader->SetTexture("heightmap", tex);
-                arg.renderer.LoadTexture(tex);
+        GrassNode::~GrassNode(){
+            if (heightmap)
+                heightmap->LoadedEvent().Detach(*this);
+        }
 
-                Vector<2, float> heightmapDims(tex->GetWidth(),
-                                               tex->GetHeight());
-                grassShader->SetUniform("invHmapDimsScale", 1.0f / (heightmapDims * widthScale));
+        void GrassNode::SetSeed(const unsigned int seed){
+            this->seed = seed;
+            CreateStraws();
+            if (instanced){
+                grassGeom = CreateStrawObject();
+                instanceData = CreateInstanceData();
+            }else
+                grassGeom = CreateGrassObject();
+        }
 
-                grassShader->SetTexture("normalmap", heightmap->GetNormalMap());
-                arg.renderer.LoadTexture(tex);
+        void GrassNode::SetDensityMask(const UCharTexture2DPtr mask){
+            densityMask = mask;
+            terrainMask = false;
+        }
+
+        void GrassNode::SetDensityMask(const float minHeight, const float maxHeight, 
+                                       const float maxSlope, const float fade){
+            densityMask.reset();
+            terrainMask = true;
+            maskMinHeight = minHeight;
+            maskMaxHeight = maxHeight;
+            maskMaxSlope = maxSlope;
+            maskFade = fade;
+        }
+
+        void GrassNode::SetDensityLOD(const float fullDistance, const float fadeDistance, const float minDensity){
+            fullDensityDistance = fullDistance;
+            this->fadeDistance = fadeDistance < fullDistance ? fullDistance : fadeDistance;
+            this->minDensity = minDensity < 0.0f ? 0.0f : (minDensity > 1.0f ? 1.0f : minDensity);
+        }
+
+        void GrassNode::CalcCells(IViewingVolume* view){
+            cellDraws.clear();
+            drawnStraws = 0;
+            if (heightmap && !heightmapReady) return;
+
+            // Move the view position by the grid dimension relative
+            // to the eye direction and snap it to whole cells.
+            Vector<3, float> eyeDir = view->GetDirection().RotateVector(Vector<3, float>(0,0,1));
+            Vector<3, float> viewPos = view->GetPosition();
+            float halfDim = gridDim / 2;
+            float cellSize = float(gridDim) / cellsPrSide;
+            Vector<2, float> corner(viewPos.Get(0) - eyeDir.Get(0) * halfDim - halfDim, 
+                                    viewPos.Get(2) - eyeDir.Get(2) * halfDim - halfDim);
+            corner[0] = floor(corner[0] / cellSize + 0.5f) * cellSize;
+            corner[1] = floor(corner[1] / cellSize + 0.5f) * cellSize;
+            patchCenter = corner + Vector<2, float>(halfDim);
+
+            float strawHeight = STRAW_HEIGHT * MAX_STRAW_SCALE;
+            float strawWidth = STRAW_WIDTH * MAX_STRAW_SCALE / 2;
+            float fadeRange = fadeDistance - fullDensityDistance;
+
+            for (int cx = 0; cx < cellsPrSide; ++cx){
+                // Where the cell ends up in the window
+                float x = cx * cellSize - corner[0];
+                x = corner[0] + x - floor(x / gridDim) * gridDim;
+                for (int cz = 0; cz < cellsPrSide; ++cz){
+                    int cell = cz + cx * cellsPrSide;
+                    unsigned int first = cellStart[cell];
+                    unsigned int count = cellStart[cell+1] - first;
+                    if (count == 0) continue;
+
+                    float z = cz * cellSize - corner[1];
+                    z = corner[1] + z - floor(z / gridDim) * gridDim;
+
+                    // The terrain height is sampled at the corners and
+                    // center of the cell, padded by half the cell size
+                    // for the bumps in between.
+                    Vector<3, float> min(x - strawWidth, 0, z - strawWidth);
+                    Vector<3, float> max(x + cellSize + strawWidth, 0, z + cellSize + strawWidth);
+                    if (heightmap){
+                        float low = heightmap->GetHeight(x + cellSize / 2, z + cellSize / 2);
+                        float high = low;
+                        for (int i = 0; i < 4; ++i){
+                            float h = heightmap->GetHeight(x + (i / 2) * cellSize, z + (i % 2) * cellSize);
+                            low = std::min(low, h);
+                            high = std::max(high, h);
+                        }
+                        min[1] = low - cellSize / 2;
+                        max[1] = high + cellSize / 2 + strawHeight;
+                    }else
+                        max[1] = strawHeight;
+
+                    Vector<3, float> center = (min + max) * 0.5f;
+                    if (!view->IsVisible(Geometry::Box(center, max - center)))
+                        continue;
+
+                    // Thin out the straws of distant cells
+                    if (minDensity < 1.0f){
+                        float distance = (center - viewPos).GetLength();
+                        float density = 1.0f;
+                        if (distance >= fadeDistance)
+                            density = minDensity;
+                        else if (distance > fullDensityDistance)
+                            density = 1.0f - (1.0f - minDensity) * (distance - fullDensityDistance) / fadeRange;
+                        count = (unsigned int)ceil(count * density);
+                        if (count == 0) continue;
+                    }
+
+                    CellDraw draw;
+                    draw.first = first;
+                    draw.count = count;
+                    cellDraws.push_back(draw);
+                    drawnStraws += count;
+                }
+            }
+        }
 
-                Vector<3, float> offset = heightmap->GetOffset();
-                grassShader->SetUniform("hmapOffset", Vector<2, float>(offset.Get(0), offset.Get(2)));
+        void GrassNode::SetInstanced(const bool instanced){
+            if (this->instanced == instanced) return;
+            this->instanced = instanced;
+            if (instanced){
+                grassGeom = CreateStrawObject();
+                instanceData = CreateInstanceData();
+            }else{
+                grassGeom = CreateGrassObject();
+                instanceData.reset();
+            }
+        }
+        
+        void GrassNode::Handle(RenderingEventArg arg){
+            if (instanced && !GLEW_ARB_draw_instanced){
+                logger.warning << "Instancing not supported, grass uses expanded geometry." << logger.end;
+                SetInstanced(false);
+            }
+
+            if (grassShader){
+                // A heightmap still loading is set up when LoadedEvent
+                // fires.
+                if (heightmap && heightmap->IsReady())
+                    SetupHeightMap(arg.renderer);
                 
                 grassShader->SetUniform("gridDim", float(gridDim));
                 grassShader->SetUniform("invGridDim", 1.0f / float(gridDim));
 
+                if (!terrainMask && densityMask != NULL){
+                    grassShader->SetTexture("densityMask", densityMask);
+                    arg.renderer.LoadTexture(densityMask);
+                }
+                if (!terrainMask)
+                    grassShader->SetUniform("densityMasked", densityMask != NULL ? 1.0f : 0.0f);
+
+                if (instanced){
+                    grassShader->SetTexture("instanceData", instanceData);
+                    arg.renderer.LoadTexture(instanceData);
+                    grassShader->SetUniform("instanceDataDims", 
+                                            Vector<2, float>(instanceData->GetWidth(), 
+                                                             instanceData->GetHeight()));
+                }
+
                 grassShader->Load();
 
+                ITexture2DPtr tex;
                 grassShader->GetTexture("grassTex", tex);
                 tex->Load();
                 
@@ -90,36 +264,243 @@ namespace OpenEngine {
                 arg.renderer.LoadTexture(tex);
                 tex->Unload();
             }
+            initialized = true;
         }
 
         void GrassNode::Handle(Core::ProcessEventArg arg){
             elapsedTime += arg.approx;
         }
 
-        GeometrySetPtr GrassNode::CreateGrassObject() {
-            RandomGenerator rand;
-            rand.SeedWithTime();
+        void GrassNode::Handle(HeightMapLoadedEventArg arg){
+            // Before the grass is initialized the heightmap is set up
+            // with the rest of the shader.
+            if (initialized && grassShader)
+                SetupHeightMap(arg.renderer);
+        }
 
-            float radsPrQuad = PI / quadsPrObject;
+        void GrassNode::SetupHeightMap(IRenderer& renderer){
+            float widthScale = heightmap->GetWidthScale();
+
+            ITexture2DPtr tex = heightmap->GetHeightMap();
+            grassShader->SetTexture("heightmap", tex);
+            renderer.LoadTexture(tex);
+
+            Vector<2, float> heightmapDims(tex->GetWidth(),
+                                           tex->GetHeight());
+            grassShader->SetUniform("invHmapDimsScale", 1.0f / (heightmapDims * widthScale));
+
+            ITexture2DPtr normalmap = heightmap->GetNormalMap();
+            grassShader->SetTexture("normalmap", normalmap);
+            renderer.LoadTexture(normalmap);
+
+            Vector<3, float> offset = heightmap->GetOffset();
+            grassShader->SetUniform("hmapOffset", Vector<2, float>(offset.Get(0), offset.Get(2)));
+
+            if (terrainMask){
+                densityMask = CreateDensityMask(maskMinHeight, maskMaxHeight, maskMaxSlope, maskFade);
+                grassShader->SetTexture("densityMask", densityMask);
+                renderer.LoadTexture(densityMask);
+                grassShader->SetUniform("densityMasked", 1.0f);
+            }
+
+            heightmapReady = true;
+        }
+
+        /**
+         * A small deterministic random generator, one per placement
+         * tile, so the tiles can be generated in parallel and give
+         * the same straws for the same seed.
+         */
+        class TileRandom {
+            unsigned int state;
+        public:
+            TileRandom(unsigned int seed, unsigned int tile) {
+                // Scramble the seed and tile, xorshift must not start
+                // at 0.
+                state = seed * 2654435761u ^ (tile + 1) * 2246822519u;
+                if (state == 0) state = 1;
+                for (int i = 0; i < 4; ++i) Next();
+            }
+            unsigned int Next() {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                return state;
+            }
+            float UniformFloat(float min, float max) {
+                return min + (max - min) * float(Next() >> 8) / float(1 << 24);
+            }
+        };
+
+        void GrassNode::CreateStraws() {
+            if (seed == 0){
+                RandomGenerator rand;
+                rand.SeedWithTime();
+                usedSeed = (unsigned int)rand.UniformInt(1, 1 << 30);
+            }else
+                usedSeed = seed;
 
-            const float WIDTH = 3;
-            const float HEIGHT = 3;
+            strawData.clear();
+            float area = float(gridDim) * float(gridDim);
+            if (straws > 0 && area > 0.0f){
+                // The minimum distance between straws that fits
+                // somewhat more straws than requested.
+                float radius = sqrt(POISSON_PACKING * area / straws);
+
+                // The tiles are at least the radius wide and an even
+                // number per side, so the tiles of the same phase in
+                // a 2 x 2 checkerboard never read each others straws,
+                // also where the window wraps. The acceleration grid
+                // has at most one straw per cell.
+                int tilesPrSide = std::min(MAX_TILES_PR_SIDE, 2 * int(gridDim / (2 * radius)));
+                tilesPrSide = std::max(2, tilesPrSide);
+                float tileSize = float(gridDim) / tilesPrSide;
+                int cellsPrTile = int(ceil(tileSize * sqrt(2.0f) / radius));
+                int gridCells = tilesPrSide * cellsPrTile;
+                float cellSize = tileSize / cellsPrTile;
+                int reach = std::min(int(ceil(radius / cellSize)), gridCells / 2);
+
+                vector<Vector<2, float> > grid(gridCells * gridCells);
+                vector<char> used(gridCells * gridCells, 0);
+                vector<vector<Straw> > tiles(tilesPrSide * tilesPrSide);
+
+                int tileCount = tilesPrSide * tilesPrSide;
+                float radiusSquared = radius * radius;
+                float dim = float(gridDim);
+                
+                for (int phase = 0; phase < 4; ++phase){
+#pragma omp parallel for schedule(dynamic)
+                    for (int t = 0; t < tileCount; ++t){
+                        int tx = t / tilesPrSide, tz = t % tilesPrSide;
+                        if ((tx % 2) * 2 + tz % 2 != phase) continue;
+
+                        TileRandom rand(usedSeed, t);
+                        int quota = straws / tileCount + (t < straws % tileCount ? 1 : 0);
+                        int attempts = quota * POISSON_ATTEMPTS;
+                        vector<Straw>& placed = tiles[t];
+                        placed.reserve(quota);
+                        for (int a = 0; a < attempts && (int)placed.size() < quota; ++a){
+                            float x = (tx + rand.UniformFloat(0, 1)) * tileSize;
+                            float z = (tz + rand.UniformFloat(0, 1)) * tileSize;
+                            int gx = std::min(int(x / cellSize), gridCells - 1);
+                            int gz = std::min(int(z / cellSize), gridCells - 1);
+                            if (used[gz + gx * gridCells]) continue;
+
+                            // Compare with the straws in reach, the
+                            // window wraps around.
+                            bool free = true;
+                            for (int i = -reach; i <= reach && free; ++i)
+                                for (int j = -reach; j <= reach && free; ++j){
+                                    int cx = (gx + i + gridCells) % gridCells;
+                                    int cz = (gz + j + gridCells) % gridCells;
+                                    int c = cz + cx * gridCells;
+                                    if (!used[c]) continue;
+                                    float dx = fabs(grid[c][0] - x);
+                                    float dz = fabs(grid[c][1] - z);
+                                    dx = std::min(dx, dim - dx);
+                                    dz = std::min(dz, dim - dz);
+                                    free = dx * dx + dz * dz >= radiusSquared;
+                                }
+                            if (!free) continue;
+
+                            grid[gz + gx * gridCells] = Vector<2, float>(x, z);
+                            used[gz + gx * gridCells] = 1;
+
+                            Straw straw;
+                            straw.x = x;
+                            straw.z = z;
+                            straw.rotation = rand.UniformFloat(0, 2 * PI);
+                            straw.scale = rand.UniformFloat(0.8f, MAX_STRAW_SCALE);
+                            straw.priority = rand.UniformFloat(0, 1);
+                            placed.push_back(straw);
+                        }
+                    }
+                }
+
+                for (int t = 0; t < tileCount; ++t)
+                    strawData.insert(strawData.end(), tiles[t].begin(), tiles[t].end());
+            }
+
+            float cellSize = float(gridDim) / cellsPrSide;
+            for (unsigned int j = 0; j < strawData.size(); ++j){
+                Straw& straw = strawData[j];
+                int cx = std::min(int(straw.x / cellSize), cellsPrSide - 1);
+                int cz = std::min(int(straw.z / cellSize), cellsPrSide - 1);
+                straw.cell = cz + cx * cellsPrSide;
+            }
+            std::sort(strawData.begin(), strawData.end());
+
+            unsigned int cells = cellsPrSide * cellsPrSide;
+            cellStart.resize(cells + 1);
+            unsigned int j = 0;
+            for (unsigned int c = 0; c <= cells; ++c){
+                while (j < strawData.size() && strawData[j].cell < int(c)) ++j;
+                cellStart[c] = j;
+            }
+        }
+
+        UCharTexture2DPtr GrassNode::CreateDensityMask(const float minHeight, const float maxHeight, 
+                                                       const float maxSlope, const float fade) const{
+            const HeightMapNode* terrain = heightmap;
+            FloatTexture2DPtr tex = terrain->GetHeightMap();
+            int width = tex->GetWidth();
+            int depth = tex->GetHeight();
+            float widthScale = heightmap->GetWidthScale();
+            Vector<3, float> offset = heightmap->GetOffset();
+
+            UCharTexture2DPtr mask = UCharTexture2DPtr(new UCharTexture2D(width, depth, 1));
+            mask->SetWrapping(CLAMP_TO_EDGE);
+            mask->Load();
+            unsigned char* data = mask->GetData();
+
+            float heightFade = std::max(fade * (maxHeight - minHeight), 1e-6f);
+            float slopeFade = std::max(fade * maxSlope, 1e-6f);
+            
+#pragma omp parallel for
+            for (int v = 0; v < depth; ++v)
+                for (int u = 0; u < width; ++u){
+                    // The texel is sampled where the grass shader
+                    // samples the heightmap.
+                    float x = offset.Get(0) + u * widthScale;
+                    float z = offset.Get(2) + v * widthScale;
+                    float height = terrain->GetHeight(x, z);
+                    float slope = acos(std::min(terrain->GetNormal(x, z).Get(1), 1.0f));
+
+                    float density = std::min((height - minHeight) / heightFade, 1.0f);
+                    density = std::min(density, (maxHeight - height) / heightFade);
+                    density = std::min(density, (maxSlope - slope) / slopeFade);
+                    density = std::max(density, 0.0f);
+                    data[u + v * width] = (unsigned char)(density * 255.0f + 0.5f);
+                }
+
+            return mask;
+        }
+
+        GeometrySetPtr GrassNode::CreateGrassObject() {
+            float radsPrQuad = PI / quadsPrObject;
 
             const int texsPrQuad = 1;
 
-            unsigned int blockSize = 4 * quadsPrObject * straws;
+            int placed = strawData.size();
+            unsigned int blockSize = 4 * quadsPrObject * placed;
 
             Float3DataBlockPtr vertices = Float3DataBlockPtr(new DataBlock<3, float>(blockSize));
             Float3DataBlockPtr center = Float3DataBlockPtr(new DataBlock<3, float>(blockSize));
             Float2DataBlockPtr texCoords = Float2DataBlockPtr(new DataBlock<2, float>(blockSize));
             Float2DataBlockPtr noise = Float2DataBlockPtr(new DataBlock<2, float>(blockSize));
 
-            int index = 0;
-            for (int j = 0; j < straws; ++j){
-                // Create geometry for the quads
-                Vector<3, float> position = Vector<3, float>(rand.UniformFloat(0, gridDim), 0, 
-                                                             rand.UniformFloat(0, gridDim));
-                float rotationOffset = rand.UniformFloat(0, 2 * PI);
+            // Every straw writes its own vertices.
+#pragma omp parallel for
+            for (int j = 0; j < placed; ++j){
+                int index = j * 4 * quadsPrObject;
+                // Create geometry for the quads, the center carries
+                // the priority for the density mask.
+                const Straw& straw = strawData[j];
+                Vector<3, float> position = Vector<3, float>(straw.x, 0, straw.z);
+                Vector<3, float> centerPriority = Vector<3, float>(straw.x, straw.priority, straw.z);
+                float rotationOffset = straw.rotation;
+                const float WIDTH = STRAW_WIDTH * straw.scale;
+                const float HEIGHT = STRAW_HEIGHT * straw.scale;
             
                 for (int i = 0; i < quadsPrObject; ++i){
                     Vector<3, float> direction = Vector<3, float>(cos(i * radsPrQuad + rotationOffset),
@@ -127,25 +508,25 @@ namespace OpenEngine {
                     
                     // lower left
                     vertices->SetElement(index, position + direction * WIDTH / 2 * texsPrQuad);
-                    center->SetElement(index, position);
+                    center->SetElement(index, centerPriority);
                     texCoords->SetElement(index, Vector<2, float>(0, 0));
                     ++index;
                         
                     // upper left
                     vertices->SetElement(index, position + direction * WIDTH / 2 * texsPrQuad + Vector<3, float>(0, HEIGHT, 0));
-                    center->SetElement(index, position);
+                    center->SetElement(index, centerPriority);
                     texCoords->SetElement(index, Vector<2, float>(0, 1));
                     ++index;
                         
                     // upper right
                     vertices->SetElement(index, position + direction * WIDTH / -2 * texsPrQuad + Vector<3, float>(0, HEIGHT, 0));
-                    center->SetElement(index, position);
+                    center->SetElement(index, centerPriority);
                     texCoords->SetElement(index, Vector<2, float>(1 * texsPrQuad, 1));
                     ++index;
                         
                     // lower right
                     vertices->SetElement(index, position + direction * WIDTH / -2 * texsPrQuad);
-                    center->SetElement(index, position);
+                    center->SetElement(index, centerPriority);
                     texCoords->SetElement(index, Vector<2, float>(1 * texsPrQuad, 0));
                     ++index;
                 }
@@ -159,5 +540,74 @@ namespace OpenEngine {
             return GeometrySetPtr(geom);
         }
 
+        GeometrySetPtr GrassNode::CreateStrawObject() {
+            float radsPrQuad = PI / quadsPrObject;
+
+            unsigned int blockSize = 4 * quadsPrObject;
+
+            Float3DataBlockPtr vertices = Float3DataBlockPtr(new DataBlock<3, float>(blockSize));
+            Float3DataBlockPtr center = Float3DataBlockPtr(new DataBlock<3, float>(blockSize));
+            Float2DataBlockPtr texCoords = Float2DataBlockPtr(new DataBlock<2, float>(blockSize));
+
+            // The straw is placed by the shader, so the center
+            // attribute is the origin.
+            Vector<3, float> up(0, STRAW_HEIGHT, 0);
+            int index = 0;
+            for (int i = 0; i < quadsPrObject; ++i){
+                Vector<3, float> direction = Vector<3, float>(cos(i * radsPrQuad), 0, sin(i * radsPrQuad));
+                Vector<3, float> side = direction * STRAW_WIDTH / 2;
+
+                vertices->SetElement(index, side);
+                center->SetElement(index, Vector<3, float>(0.0f));
+                texCoords->SetElement(index++, Vector<2, float>(0, 0));
+
+                vertices->SetElement(index, side + up);
+                center->SetElement(index, Vector<3, float>(0.0f));
+                texCoords->SetElement(index++, Vector<2, float>(0, 1));
+
+                vertices->SetElement(index, up - side);
+                center->SetElement(index, Vector<3, float>(0.0f));
+                texCoords->SetElement(index++, Vector<2, float>(1, 1));
+
+                vertices->SetElement(index, -side);
+                center->SetElement(index, Vector<3, float>(0.0f));
+                texCoords->SetElement(index++, Vector<2, float>(1, 0));
+            }
+
+            IDataBlockList tcs;
+            tcs.push_back(texCoords);
+
+            return GeometrySetPtr(new GeometrySet(vertices, center, tcs));
+        }
+
+        FloatTexture2DPtr GrassNode::CreateInstanceData() {
+            unsigned int width = INSTANCE_DATA_WIDTH;
+            unsigned int height = (strawData.size() + width - 1) / width;
+            if (height == 0) height = 1;
+
+            FloatTexture2DPtr data = FloatTexture2DPtr(new FloatTexture2D(width, height, 4));
+            data->SetMipmapping(false);
+            data->SetWrapping(CLAMP_TO_EDGE);
+            data->Load();
+
+            int texels = width * height;
+#pragma omp parallel for
+            for (int i = 0; i < texels; ++i){
+                float* texel = data->GetData() + i * 4;
+                if (i < (int)strawData.size()){
+                    texel[0] = strawData[i].x;
+                    texel[1] = strawData[i].z;
+                    // Whole turns don't change the rotation, they
+                    // carry the priority for the density mask.
+                    texel[2] = strawData[i].rotation + 2 * PI * floor(strawData[i].priority * PRIORITY_LEVELS);
+                    texel[3] = strawData[i].scale;
+                }else
+                    // Padding, never drawn
+                    texel[0] = texel[1] = texel[2] = texel[3] = 0.0f;
+            }
+
+            return data;
+        }
+
     }
 }
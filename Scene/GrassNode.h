@@ -16,6 +16,9 @@
 #include <Core/IListener.h>
 #include <Math/Vector.h>
 #include <Renderers/IRenderer.h>
+#include <Resources/Texture2D.h>
+
+#include <vector>
 
 using namespace OpenEngine;
 using namespace OpenEngine::Core;
@@ -23,6 +26,9 @@ using namespace OpenEngine::Math;
 using namespace OpenEngine::Renderers;
 
 namespace OpenEngine {
+    namespace Display {
+        class IViewingVolume;
+    }
     namespace Geometry {
         class Mesh;
         typedef boost::shared_ptr<Mesh> MeshPtr;
@@ -35,44 +41,200 @@ namespace OpenEngine {
     }
     namespace Scene {
         class HeightMapNode;
-
+        struct HeightMapLoadedEventArg;
 
         class GrassNode : public ISceneNode,
             public IListener<RenderingEventArg>, 
-            public IListener<Core::ProcessEventArg> {
+            public IListener<Core::ProcessEventArg>,
+            public IListener<HeightMapLoadedEventArg> {
             OE_SCENE_NODE(GrassNode, ISceneNode);
+        public:
+            /**
+             * A range of straws to draw.
+             */
+            struct CellDraw {
+                unsigned int first, count;
+            };
+
         private:
+            struct Straw {
+                float x, z, rotation, scale;
+                // Straws of low priority are thinned out first.
+                float priority;
+                int cell;
+                bool operator<(const Straw& other) const {
+                    return cell < other.cell || (cell == other.cell && priority > other.priority);
+                }
+            };
+
             Geometry::GeometrySetPtr grassGeom;
             Resources::IShaderResourcePtr grassShader;
 
-            // Heightmap to place the grass one
+            // Heightmap to place the grass one. Its textures are
+            // bound once it is ready, no grass is drawn before.
             HeightMapNode* heightmap;
+            bool initialized, heightmapReady;
 
             // Grass grid dimensions
             int gridDim;
             int straws;
             int quadsPrObject;
 
+            // The straws sorted by cell and priority, cellStart[c] is
+            // the first straw of cell c.
+            unsigned int seed, usedSeed;
+            int cellsPrSide;
+            std::vector<Straw> strawData;
+            std::vector<unsigned int> cellStart;
+
+            // Density LOD
+            float fullDensityDistance, fadeDistance, minDensity;
+
+            // The cells selected for the last view
+            Vector<2, float> patchCenter;
+            std::vector<CellDraw> cellDraws;
+            unsigned int drawnStraws;
+
+            // Instanced rendering, one straw mesh and a texel of
+            // instance data per straw.
+            bool instanced;
+            Resources::FloatTexture2DPtr instanceData;
+
+            // Where the grass grows
+            Resources::UCharTexture2DPtr densityMask;
+            bool terrainMask;
+            float maskMinHeight, maskMaxHeight, maskMaxSlope, maskFade;
+
             unsigned int elapsedTime;
 
         public:
             GrassNode();
             GrassNode(HeightMapNode* heightmap, const Resources::IShaderResourcePtr shader, 
-                      int straws = 4000, int gridDimension = 64, int quadsPrObject = 3);
+                      int straws = 4000, int gridDimension = 64, int quadsPrObject = 3,
+                      int cellsPrSide = 8);
+            ~GrassNode();
 
             void Handle(RenderingEventArg arg);
             void Handle(Core::ProcessEventArg arg);
+            void Handle(HeightMapLoadedEventArg arg);
 
             inline int GetGridDimension() const { return gridDim; }
             inline Resources::IShaderResourcePtr GetGrassShader() const { return grassShader; }
             inline Geometry::GeometrySetPtr GetGrassGeometry() const { return grassGeom; }
             inline unsigned int GetElapsedTime() const { return elapsedTime; }
+            /**
+             * The number of straws placed, at most the number asked
+             * for.
+             */
+            inline int GetStraws() const { return strawData.size(); }
+            inline int GetQuadsPrObject() const { return quadsPrObject; }
+
+            /**
+             * Draws the grass instanced. The geometry is then a single
+             * straw at the origin and the shader places each instance
+             * from the RGBA float texture "instanceData", holding the
+             * x and z position, rotation around the y axis and scale
+             * of straw id = gl_InstanceID + instanceOffset at texel
+             * (id % w, id / w), where the uniform "instanceDataDims"
+             * is (w, h). The uniform "instanceOffset" is the first
+             * straw of the cell being drawn.
+             *
+             * The vertex memory no longer grows with the number of
+             * straws. Must be set before the grass is initialized and
+             * falls back to the expanded geometry if instancing isn't
+             * supported.
+             */
+            void SetInstanced(const bool instanced);
+            inline bool IsInstanced() const { return instanced; }
+            inline Resources::FloatTexture2DPtr GetInstanceData() const { return instanceData; }
+
+            /**
+             * Places the straws with a Poisson disk distribution
+             * generated from the seed, so the grass is the same every
+             * run. The default seed 0 uses the time, GetSeed returns
+             * the seed actually used. Must be set before the grass is
+             * initialized.
+             */
+            void SetSeed(const unsigned int seed);
+            inline unsigned int GetSeed() const { return usedSeed; }
+
+            /**
+             * Limits where the grass grows with a mask over the
+             * heightmap, sampled like the heightmap texture. The mask
+             * is bound as "densityMask" and "densityMasked" is set to
+             * 1. A straw is drawn where its priority p, the center
+             * attribute's y or floor(rotation / 2pi) / 256 of the
+             * instance data, is at least 1 - mask.
+             *
+             * Must be set before the grass is initialized.
+             */
+            void SetDensityMask(const Resources::UCharTexture2DPtr mask);
+            /**
+             * Grows the grass between the heights and on slopes less
+             * than maxSlope radians, fading out over the fraction
+             * fade of the ranges. The mask is computed from the
+             * heightmap when the grass is initialized.
+             */
+            void SetDensityMask(const float minHeight, const float maxHeight, 
+                                const float maxSlope, const float fade = 0.1f);
+            inline Resources::UCharTexture2DPtr GetDensityMask() const { return densityMask; }
+
+            /**
+             * Thins out the straws of cells further away than
+             * fullDistance, down to minDensity of the straws at
+             * fadeDistance and beyond. The straws are removed one at
+             * a time in a fixed random order, so the thinning doesn't
+             * pop.
+             */
+            void SetDensityLOD(const float fullDistance, const float fadeDistance, const float minDensity);
+            inline float GetFullDensityDistance() const { return fullDensityDistance; }
+            inline float GetFadeDistance() const { return fadeDistance; }
+            inline float GetMinDensity() const { return minDensity; }
+
+            /**
+             * Places the grass window in front of the view, frustum
+             * culls its cells and selects the number of straws to
+             * draw in each.
+             *
+             * The grass covers the gridDim x gridDim window centered
+             * at GetPatchCenter(), a straw at local position p is
+             * drawn at corner + mod(p - corner, gridDim), where corner
+             * is the lower corner of the window. The center is
+             * snapped to whole cells, so every cell covers a single
+             * area of the window.
+             */
+            void CalcCells(Display::IViewingVolume* view);
+            inline Vector<2, float> GetPatchCenter() const { return patchCenter; }
+            /**
+             * The straw ranges to draw, in the order of the expanded
+             * geometry and the instance data.
+             */
+            inline const std::vector<CellDraw>& GetCellDraws() const { return cellDraws; }
+            inline unsigned int GetDrawnStraws() const { return drawnStraws; }
+            inline int GetCellsPrSide() const { return cellsPrSide; }
             
         private:
+            /**
+             * Places the straws and sorts them by cell and priority.
+             * The tiles of the window are filled in parallel.
+             */
+            inline void CreateStraws();
+            /**
+             * Binds the heightmap textures and computes the density
+             * mask from the terrain.
+             */
+            inline void SetupHeightMap(IRenderer& renderer);
+            inline Resources::UCharTexture2DPtr CreateDensityMask(const float minHeight, const float maxHeight, 
+                                                                  const float maxSlope, const float fade) const;
             /**
              * Creates the grass star object.
              */
             inline Geometry::GeometrySetPtr CreateGrassObject();
+            /**
+             * Creates a single straw at the origin for instancing.
+             */
+            inline Geometry::GeometrySetPtr CreateStrawObject();
+            inline Resources::FloatTexture2DPtr CreateInstanceData();
 
         };
 
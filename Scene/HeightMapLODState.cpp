@@ -0,0 +1,60 @@
+// Heightfield LOD state.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapLODState.h>
+#include <Display/IViewingVolume.h>
+#include <Geometry/Box.h>
+
+#include <cmath>
+
+using namespace OpenEngine::Display;
+
+namespace OpenEngine {
+    namespace Scene {
+
+        HeightMapLODState::HeightMapLODState()
+            : reflection(false), mirrorHeight(0.0f), clipHeight(0.0f),
+              lodBias(0.0f), distanceScale(1.0f),
+              sortHeightVersion(0), sorts(0), sortValid(false), lodVersion(0),
+              errorScale(0.0f), lodUpdates(0), lodSkips(0),
+              triangleCount(0), drawCallCount(0), occludedPatches(0) {}
+
+        void HeightMapLODState::SetReflection(const bool reflect, const float mirror, const float clip){
+            reflection = reflect;
+            mirrorHeight = mirror;
+            clipHeight = clip;
+        }
+
+        void HeightMapLODState::SetLODBias(const float bias){
+            lodBias = bias;
+            distanceScale = pow(2.0f, -bias);
+        }
+
+        Vector<3, float> HeightMapLODState::GetViewPosition(IViewingVolume* view) const{
+            Vector<3, float> viewPos = view->GetPosition();
+            if (reflection)
+                viewPos[1] = 2.0f * mirrorHeight - viewPos[1];
+            return viewPos;
+        }
+
+        bool HeightMapLODState::IsVisible(IViewingVolume* view, const Vector<3, float>& min, const Vector<3, float>& max) const{
+            Vector<3, float> center = (min + max) / 2;
+            Vector<3, float> extent = max - center;
+            if (reflection){
+                // Only the terrain above the clip plane is reflected,
+                // and the mirror sees what the view sees of the
+                // mirrored box.
+                if (max[1] < clipHeight) return false;
+                center[1] = 2.0f * mirrorHeight - center[1];
+            }
+            return view->IsVisible(Geometry::Box(center, extent));
+        }
+
+    }
+}
@@ -0,0 +1,138 @@
+// Heightfield LOD state.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_LOD_STATE_H_
+#define _HEIGHTFIELD_LOD_STATE_H_
+
+#include <Scene/HeightMapPatch.h>
+#include <Scene/HeightMapQuadTree.h>
+
+#include <vector>
+
+namespace OpenEngine {
+    namespace Display {
+        class IViewingVolume;
+    }
+    namespace Scene {
+        class HeightMapNode;
+
+        /**
+         * The result of selecting the LODs of a heightmap for a
+         * view: the visible patches, their LODs and the quadtree
+         * selection, along with the frame coherent data reused by
+         * the next selection for the same view.
+         *
+         * Give every view, fx a reflection, shadow or split screen
+         * view, its own state. The states of different views can be
+         * computed concurrently, see HeightMapNode::CalcLOD.
+         *
+         * A state can select the LODs for a view mirrored in a
+         * horizontal plane, fx for a water reflection, and can be
+         * biased towards coarser LODs for views that need less
+         * detail.
+         */
+        class HeightMapLODState {
+            friend class HeightMapNode;
+            friend class HeightMapQuadTree;
+
+        protected:
+            // The view settings
+            bool reflection;
+            float mirrorHeight, clipHeight;
+            float lodBias, distanceScale;
+
+            std::vector<PatchLODState> patches;
+            std::vector<HeightMapQuadTree::Selection> selection;
+            std::vector<int> drawOrder;
+
+            // All patches sorted by their distance to the position
+            // they were sorted at.
+            std::vector<int> sortedPatches;
+            Vector<3, float> sortViewPos;
+            unsigned int sortHeightVersion, sorts;
+            bool sortValid;
+            std::vector<float> horizon;
+
+            // The LOD settings the patch states were computed with.
+            unsigned int lodVersion;
+
+            float errorScale;
+            unsigned int lodUpdates, lodSkips;
+            unsigned int triangleCount, drawCallCount;
+            unsigned int occludedPatches;
+
+        public:
+            HeightMapLODState();
+
+            /**
+             * Selects the LODs for the view mirrored in the plane y =
+             * mirrorHeight, culling the terrain below clipHeight, so
+             * the state matches a reflection rendered with a clip
+             * plane. Horizon occlusion culling isn't used for
+             * reflections.
+             */
+            void SetReflection(const bool reflect, const float mirrorHeight = 0.0f, const float clipHeight = 0.0f);
+            bool IsReflection() const { return reflection; }
+            /**
+             * Selects coarser LODs by scaling the LOD distances, and
+             * the screen space error tolerance, by 2^bias. A bias of
+             * 1 makes every LOD switch at half the distance.
+             */
+            void SetLODBias(const float bias);
+            float GetLODBias() const { return lodBias; }
+            /**
+             * The factor the LOD distances are scaled by, 2^-bias.
+             */
+            float GetDistanceScale() const { return distanceScale; }
+
+            /**
+             * The position of the view, mirrored for reflections.
+             */
+            Vector<3, float> GetViewPosition(Display::IViewingVolume* view) const;
+            /**
+             * Checks if the box from min to max is seen by the view,
+             * mirrored and clipped for reflections.
+             */
+            bool IsVisible(Display::IViewingVolume* view, const Vector<3, float>& min, const Vector<3, float>& max) const;
+
+            /**
+             * The LOD of a patch, visible or not.
+             */
+            const PatchLODState& GetPatchLOD(const int patch) const { return patches[patch]; }
+            bool IsPatchVisible(const int patch) const { return patches[patch].visible; }
+            /**
+             * The visible patches near to far.
+             */
+            const std::vector<int>& GetDrawOrder() const { return drawOrder; }
+            /**
+             * The quadtree nodes selected in QUADTREE_LOD mode.
+             */
+            const std::vector<HeightMapQuadTree::Selection>& GetSelection() const { return selection; }
+            /**
+             * The number of times the patches have been sorted by
+             * distance. They are only sorted again once the view
+             * has moved or the heights have changed.
+             */
+            unsigned int GetDrawOrderSorts() const { return sorts; }
+            /**
+             * Pixels per unit of error at distance 1 divided by the
+             * tolerance, 0 when the screen space error isn't used.
+             */
+            float GetErrorScale() const { return errorScale; }
+            unsigned int GetLODUpdates() const { return lodUpdates; }
+            unsigned int GetLODSkips() const { return lodSkips; }
+            unsigned int GetTriangleCount() const { return triangleCount; }
+            unsigned int GetDrawCallCount() const { return drawCallCount; }
+            unsigned int GetOccludedPatches() const { return occludedPatches; }
+        };
+
+    }
+}
+
+#endif
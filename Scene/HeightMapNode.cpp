@@ -9,98 +9,318 @@
 
 #include <Scene/HeightMapNode.h>
 #include <Scene/HeightMapPatch.h>
+#include <Scene/HeightMapQuadTree.h>
 #include <Resources/IShaderResource.h>
 #include <Math/Math.h>
 #include <Meta/OpenGL.h>
 #include <Utils/TerrainUtils.h>
+#include <Utils/TerrainTexUtils.h>
+#include <Utils/TerrainCache.h>
 #include <Display/IViewingVolume.h>
 #include <Display/Viewport.h>
 #include <Geometry/GeometrySet.h>
+#include <Utils/Timer.h>
+#include <Core/Thread.h>
 
 #include <Logging/Logger.h>
 
 #include <algorithm>
+#include <cfloat>
 #include <cstring>
 
 using namespace OpenEngine::Display;
+using namespace OpenEngine::Utils;
 
 namespace OpenEngine {
     namespace Scene {
 
+        /**
+         * Buffers viewing the sections of a mapped terrain cache. The
+         * mapping is copy on write, so the data can be changed, and
+         * it is kept open as long as a buffer uses it. The data
+         * belongs to the mapping and isn't freed or unloaded.
+         */
+        template <int N, class T>
+        class MappedDataBlock : public DataBlock<N, T> {
+            TerrainCachePtr cache;
+        public:
+            MappedDataBlock(unsigned int size, const void* section, TerrainCachePtr cache)
+                : DataBlock<N, T>(size, (T*)section), cache(cache) {}
+            ~MappedDataBlock() { this->data = NULL; }
+            void Unload() {}
+        };
+
+        class MappedIndices : public Indices {
+            TerrainCachePtr cache;
+        public:
+            MappedIndices(unsigned int size, const void* section, TerrainCachePtr cache)
+                : Indices(size, (unsigned int*)section), cache(cache) {}
+            ~MappedIndices() { this->data = NULL; }
+            void Unload() {}
+        };
+
+        class MappedTexture2D : public FloatTexture2D {
+            TerrainCachePtr cache;
+        public:
+            MappedTexture2D(unsigned int width, unsigned int height, const void* section, TerrainCachePtr cache)
+                : FloatTexture2D(width, height, 1, (float*)section), cache(cache) {}
+            ~MappedTexture2D() { this->data = NULL; }
+            void Unload() {}
+        };
+
+        /**
+         * Runs the heavy part of loading a heightmap.
+         */
+        class HeightMapLoader : public Core::Thread {
+            HeightMapNode* node;
+        public:
+            HeightMapLoader(HeightMapNode* node) : node(node) {}
+            void Run() { node->BackgroundLoad(); }
+        };
+
+        // The source textures are loaded by Load, so it can be done
+        // in the background.
         HeightMapNode::HeightMapNode(FloatTexture2DPtr tex)
             : tex(tex) {
-            tex->Load();
+            Init();
+        }
+
+        HeightMapNode::HeightMapNode(UCharTexture2DPtr tex)
+            : ucharSource(tex) {
+            Init();
+        }
+
+        HeightMapNode::HeightMapNode(Texture2DPtr(unsigned short) tex)
+            : ushortSource(tex) {
+            Init();
+        }
+
+        void HeightMapNode::Init(){
             heightScale = 1;
             widthScale = 1;
             offset = Vector<3, float>(0, 0, 0);
             
             baseDistance = 1;
             invIncDistance = 1.0f / 100.0f;
+            pixelError = 0.0f;
+            incrementalLOD = false;
+            lodHysteresis = 0.1f;
+            triangleBudget = drawCallBudget = 0;
+            budgetSmoothing = 0.2f;
+            occlusionCulling = false;
+            horizonBins = 1024;
+            horizonMapping = false;
+            horizonDistance = 64;
+            lodVersion = heightVersion = 0;
 
             isLoaded = false;
+            for (int i = 0; i < LOAD_PHASES; ++i)
+                loadTimes[i] = 0;
+
+            normals = NULL;
+            deltaValues = NULL;
+            patchNodes = NULL;
+            quadtree = NULL;
+            lodMode = PATCH_LOD;
+
+            asyncLoad = false;
+            isReady = false;
+            loader = NULL;
+            loadFinished = placeholderReady = false;
+            placeholderVertices = placeholderNormals = NULL;
 
             landscapeShader.reset();
         }
 
         HeightMapNode::~HeightMapNode(){
-            delete [] normals;
-            delete [] deltaValues;
+            if (loader != NULL){
+                loader->Wait();
+                delete loader;
+            }
+
+            // Point into the cache mapping if loaded from a cache.
+            if (cache == NULL){
+                delete [] normals;
+                delete [] deltaValues;
+            }
 
             delete [] patchNodes;
+            delete quadtree;
+
+            delete [] placeholderVertices;
+            delete [] placeholderNormals;
         }
         
         void HeightMapNode::Load() {
             if (isLoaded)
                 return;
 
+            Utils::Timer total, timer;
+            total.Start();
+
+            LoadSource();
+
+            unsigned long long hash = 0;
+            if (!cacheFile.empty()){
+                timer.Start();
+                hash = CacheHash();
+                bool cached = LoadCache(hash);
+                loadTimes[CACHE_PHASE] = timer.GetElapsedIntervals(1);
+                if (cached){
+                    SetupQuadTree();
+                    loadTimes[TOTAL_LOAD] = total.GetElapsedIntervals(1);
+                    isLoaded = true;
+                    return;
+                }
+            }
+
             InitArrays();
+
+            timer.Reset();
+            timer.Start();
             SetupPatches();
+            loadTimes[PATCH_PHASE] = timer.GetElapsedIntervals(1);
+
+            if (!cacheFile.empty()){
+                timer.Reset();
+                timer.Start();
+                SaveCache(hash);
+                loadTimes[CACHE_PHASE] += timer.GetElapsedIntervals(1);
+            }
+
+            SetupQuadTree();
+
+            loadTimes[TOTAL_LOAD] = total.GetElapsedIntervals(1);
 
             isLoaded = true;
         }
 
-        void HeightMapNode::CalcLOD(IViewingVolume* view){
-            for (int i = 0; i < numberOfPatches; ++i)
-                patchNodes[i]->CalcLOD(view);
+        bool HeightMapNode::UpdateLoad(RenderingEventArg arg){
+            if (isReady) return true;
+            if (loader == NULL) return false;
+
+            loadMutex.Lock();
+            bool finished = loadFinished;
+            loadMutex.Unlock();
+            if (!finished) return false;
+
+            loader->Wait();
+            delete loader;
+            loader = NULL;
+
+            delete [] placeholderVertices;
+            delete [] placeholderNormals;
+            placeholderVertices = placeholderNormals = NULL;
+
+            SetupBuffers(arg);
+            loadedEvent.Notify(HeightMapLoadedEventArg(this, arg.renderer));
+            return true;
+        }
+
+        void HeightMapNode::CalcLOD(IViewingVolume* view, unsigned int viewportHeight){
+            CalcLOD(view, lodState, viewportHeight);
+            UpdateLODBudget();
+        }
+
+        void HeightMapNode::CalcLOD(IViewingVolume* view, HeightMapLODState& state, 
+                                    unsigned int viewportHeight) const{
+            if (quadtree != NULL){
+                quadtree->CalcLOD(view, state);
+                return;
+            }
+
+            // Start over if the patches changed, and force the
+            // incremental updates if the LOD settings changed, since
+            // the state was last used.
+            if ((int)state.patches.size() != numberOfPatches)
+                state.patches.assign(numberOfPatches, PatchLODState());
+            else if (state.lodVersion != lodVersion)
+                for (int i = 0; i < numberOfPatches; ++i)
+                    state.patches[i].lodSlack = 0.0f;
+            state.lodVersion = lodVersion;
+
+            if (pixelError > 0 && viewportHeight > 0)
+                state.errorScale = viewportHeight / (2.0f * tan(view->GetFOV() / 2.0f)) / pixelError * state.distanceScale;
+            else
+                state.errorScale = 0.0f;
+
+            Vector<3, float> viewPos = state.GetViewPosition(view);
+            float base = baseDistance * state.distanceScale;
+            float invInc = invIncDistance / state.distanceScale;
+            state.lodUpdates = state.lodSkips = 0;
+            for (int i = 0; i < numberOfPatches; ++i){
+                HeightMapPatch* patch = patchNodes[i];
+                bool visible = state.IsVisible(view, patch->GetMin(), patch->GetMax());
+                if (patch->CalcLOD(visible, viewPos, state.errorScale, base, invInc, state.patches[i]))
+                    ++state.lodUpdates;
+                else
+                    ++state.lodSkips;
+            }
+
+            if (state.errorScale > 0 || incrementalLOD)
+                UpdateNeighbourLODs(state);
+
+            // The horizon is seen from above, so it doesn't work from
+            // the mirrored position.
+            state.occludedPatches = 0;
+            if (occlusionCulling && !state.reflection){
+                std::vector<int> candidates, occluded;
+                for (int i = 0; i < numberOfPatches; ++i)
+                    if (state.patches[i].visible)
+                        candidates.push_back(i);
+                state.horizon.resize(horizonBins);
+                ComputeOcclusion(viewPos, candidates, state, state.horizon, occluded);
+                for (unsigned int i = 0; i < occluded.size(); ++i)
+                    state.patches[occluded[i]].visible = false;
+                state.occludedPatches = occluded.size();
+            }
+
+            UpdateDrawOrder(viewPos, state);
+
+            state.triangleCount = state.drawCallCount = 0;
+            for (unsigned int i = 0; i < state.drawOrder.size(); ++i){
+                int p = state.drawOrder[i];
+                state.triangleCount += patchNodes[p]->GetNumberOfTriangles(state.patches[p]);
+                ++state.drawCallCount;
+            }
         }
 
         void HeightMapNode::Render(Renderers::RenderingEventArg arg){
+            Render(arg, lodState);
+        }
+
+        void HeightMapNode::Render(Renderers::RenderingEventArg arg, const HeightMapLODState& state){
             PreRender(arg);
 
-            // Draw patches front to back.
-            Vector<3, float> dir = arg.canvas.GetViewingVolume()->GetDirection().RotateVector(Vector<3, float>(0,0,1));
-            
-            int xStart, xEnd, xStep, zStart, zEnd, zStep;
-            if (dir[0] < 0){
-                // If we're looking along the x-axis.
-                xStart = 0;
-                xEnd = patchGridWidth;
-                xStep = 1;
-            }else{
-                // else iterate form the other side.
-                xStart = patchGridWidth-1;
-                    xEnd = -1;
-                    xStep = -1;
-            }
-            if (dir[2] < 0){
-                // If we're looking along the z-axis.
-                zStart = 0;
-                zEnd = patchGridDepth;
-                zStep = 1;
-            }else{
-                // else iterate form the other side.
-                zStart = patchGridDepth-1;
-                zEnd = -1;
-                zStep = -1;
+            // Morph with the distances the LODs were biased by.
+            bool biased = state.distanceScale != 1.0f && landscapeShader != NULL;
+            if (biased){
+                landscapeShader->SetUniform("baseDistance", baseDistance * state.distanceScale);
+                landscapeShader->SetUniform("invIncDistance", invIncDistance / state.distanceScale);
             }
-            
-            for (int x = xStart; x != xEnd ; x += xStep){
-                for (int z = zStart; z != zEnd; z += zStep){
-                    patchNodes[z + x * patchGridDepth]->Render();
-                }
+
+            if (quadtree != NULL)
+                quadtree->Render(state.selection);
+            else
+                RenderPatches(state);
+
+            if (biased){
+                landscapeShader->SetUniform("baseDistance", baseDistance);
+                landscapeShader->SetUniform("invIncDistance", invIncDistance);
             }
 
             PostRender(arg);
+        }
+
+        void HeightMapNode::RenderPatches(const HeightMapLODState& state){
+            // Draw patches front to back.
+            bool patchUniforms = state.errorScale > 0 && landscapeShader != NULL;
+            for (unsigned int i = 0; i < state.drawOrder.size(); ++i){
+                int p = state.drawOrder[i];
+                if (patchUniforms)
+                    landscapeShader->SetUniform("geomorphingScale", state.patches[p].geomorphingScale);
+                patchNodes[p]->Render(state.patches[p]);
+            }
 
             /*
             landscapeShader->ReleaseShader();
@@ -124,7 +344,31 @@ namespace OpenEngine {
             */
         }
 
+        void HeightMapNode::RenderPlaceholder(Renderers::RenderingEventArg arg){
+            loadMutex.Lock();
+            bool ready = placeholderReady;
+            loadMutex.Unlock();
+            if (!ready) return;
+
+            for (int x = 0; x < placeholderWidth - 1; ++x){
+                glBegin(GL_TRIANGLE_STRIP);
+                for (int z = 0; z < placeholderDepth; ++z){
+                    int i = (z + x * placeholderDepth) * 3;
+                    glNormal3fv(placeholderNormals + i);
+                    glVertex3fv(placeholderVertices + i);
+                    i += placeholderDepth * 3;
+                    glNormal3fv(placeholderNormals + i);
+                    glVertex3fv(placeholderVertices + i);
+                }
+                glEnd();
+            }
+        }
+
         void HeightMapNode::RenderBoundingGeometry(){
+            if (quadtree != NULL){
+                quadtree->RenderBoundingGeometry(lodState.selection);
+                return;
+            }
             for (int i = 0; i < numberOfPatches; ++i)
                 patchNodes[i]->RenderBoundingGeometry();
         }
@@ -139,8 +383,17 @@ namespace OpenEngine {
         void HeightMapNode::Handle(RenderingEventArg arg){
             Initialize(arg);
 
-            Load();
+            if (asyncLoad){
+                loader = new HeightMapLoader(this);
+                loader->Start();
+            }else{
+                Load();
+                SetupBuffers(arg);
+                loadedEvent.Notify(HeightMapLoadedEventArg(this, arg.renderer));
+            }
+        }
 
+        void HeightMapNode::SetupBuffers(RenderingEventArg arg){
             // Create vbos
             arg.renderer.BindDataBlock(vertexBuffer.get());
             arg.renderer.BindDataBlock(indexBuffer.get());
@@ -155,6 +408,21 @@ namespace OpenEngine {
                 normalmap->SetCompression(false);
                 landscapeShader->SetTexture("normalMap", (ITexture2DPtr)normalmap);
 
+                if (horizonMapping){
+                    // Laid out like the vertices, z along the rows.
+                    for (int i = 0; i < 2; ++i){
+                        horizonMaps[i] = UCharTexture2DPtr(new Texture2D<unsigned char>(depth, width, 4, 
+                                                                                         new unsigned char[width * depth * 4]));
+                        horizonMaps[i]->SetColorFormat(RGBA);
+                        horizonMaps[i]->SetWrapping(CLAMP_TO_EDGE);
+                        horizonMaps[i]->SetMipmapping(false);
+                        horizonMaps[i]->SetCompression(false);
+                    }
+                    UpdateHorizonMaps(0, 0, width, depth);
+                    landscapeShader->SetTexture("horizonMap0", (ITexture2DPtr)horizonMaps[0]);
+                    landscapeShader->SetTexture("horizonMap1", (ITexture2DPtr)horizonMaps[1]);
+                }
+
                 // Geomorph values buffer object
                 arg.renderer.BindDataBlock(geomorphBuffer.get());
 
@@ -180,6 +448,8 @@ namespace OpenEngine {
             }
 
             SetLODSwitchDistance(baseDistance, 1 / invIncDistance);
+
+            isReady = true;
         }
 
         void HeightMapNode::Handle(Core::ProcessEventArg arg){
@@ -192,6 +462,8 @@ namespace OpenEngine {
             return GetHeight(point[0], point[2]);
         }
         float HeightMapNode::GetHeight(float x, float z) const{
+            if (!HasTerrain()) return 0.0f;
+
             /**
              * http://en.wikipedia.org/wiki/Bilinear_interpolation
              */
@@ -221,6 +493,8 @@ namespace OpenEngine {
             return GetNormal(point[0], point[2]);
         }
         Vector<3, float> HeightMapNode::GetNormal(float x, float z) const{
+            if (!HasTerrain()) return Vector<3, float>(0.0f, 1.0f, 0.0f);
+
             /**
              * http://en.wikipedia.org/wiki/Bilinear_interpolation
              */
@@ -280,6 +554,11 @@ namespace OpenEngine {
         }
 
         void HeightMapNode::SetVertex(int x, int z, float value){
+            if (!isReady){
+                logger.warning << "Heightmap not ready, SetVertex ignored." << logger.end;
+                return;
+            }
+
             glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer->GetID());
             float* vbo = (float*) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
 
@@ -326,33 +605,8 @@ namespace OpenEngine {
             glBindBuffer(GL_ARRAY_BUFFER, 0);
 
             // Update shadows
-            /*
-            int shadowLeft = x < 2 ? 0 : x - 1;
-            int shadowRight = x + 3 > width ? width : x + 2;
-            int shadowBelow = z < 2 ? 0 : z - 1;
-            int shadowAbove = z + 3 > depth ? depth : z + 2;
-
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, normalsBufferId);
-            float* pbo = (float*) glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-            int pboIndex = 0;
-            for (int xi = shadowLeft; xi < shadowRight; ++xi)
-                for (int zi = shadowBelow; zi < shadowAbove; ++zi){
-                    Vector<3, float> normal = GetNormal(xi, zi);
-                    normal.ToArray(GetNormals(xi, zi));
-                    normal.ToArray(pbo + pboIndex);
-                    pboIndex += 3;
-                }
-
-            glBindTexture(GL_TEXTURE_2D, normalmap->GetID());
-
-            glTexSubImage2D(GL_TEXTURE_2D, 0, shadowLeft, shadowBelow, 
-                            shadowRight - shadowLeft, shadowAbove - shadowBelow, 
-                            GL_RGB, GL_FLOAT, 0);
-
-            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);            
-            */
+            if (horizonMaps[0] != NULL)
+                UpdateHorizonMaps(x, z, x + 1, z + 1);
 
             // Update bounding box
             HeightMapPatch* mainNode = GetPatch(x, z);
@@ -363,6 +617,8 @@ namespace OpenEngine {
             if (rightNode != mainNode) rightNode->UpdateBoundingGeometry(value);
             HeightMapPatch* upperRightNode = GetPatch(x+1, z+1);
             if (upperRightNode != mainNode) upperRightNode->UpdateBoundingGeometry(value);
+            if (quadtree != NULL) quadtree->UpdateBoundingGeometry();
+            ++heightVersion;
 
         }
 
@@ -379,6 +635,11 @@ namespace OpenEngine {
             // 
             //          Below
 
+            if (!isReady){
+                logger.warning << "Heightmap not ready, SetVertices ignored." << logger.end;
+                return;
+            }
+
             // if the area is outside the heightmap
             if (x >= width || z >= depth || x + w <= 0 || z + d <= 0) return;
 
@@ -396,49 +657,32 @@ namespace OpenEngine {
                     vbo[index * DIMENSIONS + 1] = GetVertice(index)[1] = values[(zi - z) + (xi - x) * d];
                 }
 
-            // Update the morphing height for all affected vertices
-            int morphLeft = xStart - HeightMapPatch::MAX_DELTA < 0 ? 0 : xStart - HeightMapPatch::MAX_DELTA;
-            int morphRight = xEnd + HeightMapPatch::MAX_DELTA > width ? width : xEnd + HeightMapPatch::MAX_DELTA;
-            int morphBelow = zStart - HeightMapPatch::MAX_DELTA < 0 ? 0 : zStart - HeightMapPatch::MAX_DELTA;;
-            int morphAbove = zEnd + HeightMapPatch::MAX_DELTA > depth ? depth : zEnd + HeightMapPatch::MAX_DELTA;
-
-            for (int xi = morphLeft; xi < morphRight; ++xi)
-                for (int zi = morphBelow; zi < morphAbove; ++zi){
-                    int index = CoordToIndex(xi, zi);
-                    vbo[index * DIMENSIONS + 3] = GetVertice(index)[3] = CalcGeomorphHeight(xi, zi);
-                }
+            // Update the morphing height for all affected vertices. A
+            // vertex of delta d morphs between its neighbours d away,
+            // so only the vertices of delta d within d of the area
+            // change. They lie on the grid of every d'th vertex.
+            for (int delta = 1; delta <= maxDelta; delta *= 2){
+                int morphLeft = xStart - delta < 0 ? 0 : xStart - delta;
+                int morphBelow = zStart - delta < 0 ? 0 : zStart - delta;
+                morphLeft = (morphLeft + delta - 1) / delta * delta;
+                morphBelow = (morphBelow + delta - 1) / delta * delta;
+                int morphRight = xEnd + delta > width ? width : xEnd + delta;
+                int morphAbove = zEnd + delta > depth ? depth : zEnd + delta;
+
+                for (int xi = morphLeft; xi < morphRight; xi += delta)
+                    for (int zi = morphBelow; zi < morphAbove; zi += delta){
+                        int index = CoordToIndex(xi, zi);
+                        if (GetVerticeDelta(index) != delta) continue;
+                        vbo[index * DIMENSIONS + 3] = GetVertice(index)[3] = CalcGeomorphHeight(xi, zi);
+                    }
+            }
 
             glUnmapBuffer(GL_ARRAY_BUFFER);
             glBindBuffer(GL_ARRAY_BUFFER, 0);
 
             // Update the shadows
-            /*
-            int shadowLeft = xStart < 2 ? 0 : xStart - 1;
-            int shadowRight = xEnd + 3 > width ? width : xEnd + 2;
-            int shadowBelow = zStart < 2 ? 0 : zStart - 1;
-            int shadowAbove = zEnd + 3 > depth ? depth : zEnd + 2;
-
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, normalsBufferId);
-            float* pbo = (float*) glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-            int pboIndex = 0;
-            for (int xi = shadowLeft; xi < shadowRight; ++xi)
-                for (int zi = shadowBelow; zi < shadowAbove; ++zi){
-                    Vector<3, float> normal = GetNormal(xi, zi);
-                    normal.ToArray(GetNormals(xi, zi));
-                    normal.ToArray(pbo + pboIndex);
-                    pboIndex += 3;
-                }
-
-            glBindTexture(GL_TEXTURE_2D, normalmap->GetID());
-
-            glTexSubImage2D(GL_TEXTURE_2D, 0, shadowLeft, shadowBelow, 
-                            shadowRight - shadowLeft, shadowAbove - shadowBelow, 
-                            GL_RGB, GL_FLOAT, 0);
-
-            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-            */
+            if (horizonMaps[0] != NULL)
+                UpdateHorizonMaps(xStart, zStart, xEnd, zEnd);
 
             // Update the bounding geometry
             int patchSize = HeightMapPatch::PATCH_EDGE_SQUARES;
@@ -448,6 +692,8 @@ namespace OpenEngine {
                 for (int zi = zBoundingStart; zi < zEnd; zi += patchSize){
                     GetPatch(xi, zi)->UpdateBoundingGeometry();
                 }
+            if (quadtree != NULL) quadtree->UpdateBoundingGeometry();
+            ++heightVersion;
         }
 
         Vector<3, float> HeightMapNode::GetNormal(int x, int z){
@@ -498,10 +744,15 @@ namespace OpenEngine {
         void HeightMapNode::SetLODSwitchDistance(float base, float dec){
             baseDistance = base;
             
+            // The patches are stitched to any neighbour LOD, but the
+            // quadtree nodes must fit within their ranges.
             float edgeLength = HeightMapPatch::PATCH_EDGE_SQUARES * widthScale;
-            if (dec * dec < edgeLength * edgeLength * 2){
+            if (lodMode == QUADTREE_LOD && dec * dec < edgeLength * edgeLength * 2){
                 invIncDistance = 1.0f / sqrt(edgeLength * edgeLength * 2);
                 logger.error << "Incremental LOD distance is too low, setting it to lowest value: " << 1.0f / invIncDistance << logger.end;
+            }else if (dec <= 0.0f){
+                invIncDistance = 1.0f / edgeLength;
+                logger.error << "Incremental LOD distance must be positive, setting it to: " << edgeLength << logger.end;
             }else
                 invIncDistance = 1.0f / dec;
 
@@ -509,14 +760,178 @@ namespace OpenEngine {
             if (landscapeShader != NULL){
                 landscapeShader->SetUniform("baseDistance", baseDistance);
                 landscapeShader->SetUniform("invIncDistance", invIncDistance);
+                landscapeShader->SetUniform("lodMode", (int)lodMode);
+                landscapeShader->SetUniform("morphStart", HeightMapQuadTree::MORPH_START);
             }
+
+            ++lodVersion;
+        }
+
+        void HeightMapNode::SetLODBudget(const unsigned int triangles, const unsigned int drawCalls, 
+                                         const float smoothing){
+            triangleBudget = triangles;
+            drawCallBudget = drawCalls;
+            budgetSmoothing = smoothing < 0.0f ? 0.0f : (smoothing > 1.0f ? 1.0f : smoothing);
+        }
+
+        void HeightMapNode::SetOcclusionCulling(const bool cull, const unsigned int bins){
+            occlusionCulling = cull;
+            horizonBins = bins > 0 ? bins : 1;
+        }
+
+        void HeightMapNode::SetHorizonMapping(const bool horizon, const int distance){
+            horizonMapping = horizon;
+            horizonDistance = distance > 0 ? distance : 1;
+        }
+
+        bool HeightMapNode::CheckOcclusion(Vector<3, float> viewPos, const int step) const{
+            if (patchNodes == NULL) return false;
+            // Check the culling of the entire map, not just the view,
+            // with the LODs of the main view.
+            HeightMapLODState state = lodState;
+            if ((int)state.patches.size() != numberOfPatches)
+                state.patches.assign(numberOfPatches, PatchLODState());
+            std::vector<int> candidates, occluded;
+            for (int i = 0; i < numberOfPatches; ++i)
+                candidates.push_back(i);
+            std::vector<float> horizon(horizonBins);
+            ComputeOcclusion(viewPos, candidates, state, horizon, occluded);
+
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            int inc = step > 0 ? step : 1;
+            for (unsigned int i = 0; i < occluded.size(); ++i){
+                HeightMapPatch* patch = patchNodes[occluded[i]];
+                for (int x = patch->GetXStart(); x <= patch->GetXStart() + squares; x += inc)
+                    for (int z = patch->GetZStart(); z <= patch->GetZStart() + squares; z += inc)
+                        if (IsVertexVisible(viewPos, x, z)){
+                            logger.error << "Patch " << occluded[i] << " is culled, but vertex (" << x << ", " << z << ") is visible from " << viewPos << logger.end;
+                            return false;
+                        }
+            }
+            return true;
+        }
+
+        bool HeightMapNode::CheckStitching() const{
+            if (patchNodes == NULL) return false;
+            // The patches only differ by their position, so checking
+            // one covers them all.
+            bool watertight = true;
+            for (int l = 0; l < HeightMapPatch::MAX_LODS; ++l)
+                for (int rl = 0; rl < HeightMapPatch::MAX_LODS; ++rl)
+                    for (int ul = 0; ul < HeightMapPatch::MAX_LODS; ++ul)
+                        watertight &= patchNodes[0]->CheckStitching(l, rl, ul);
+            return watertight;
+        }
+
+        void HeightMapNode::SetIncrementalLOD(const bool incremental, const float hysteresis){
+            incrementalLOD = incremental;
+            lodHysteresis = hysteresis < 0.0f ? 0.0f : hysteresis;
+            ++lodVersion;
+        }
+
+        void HeightMapNode::SetLODMode(const LODMode mode){
+            // A background load reads the mode while isLoaded is
+            // still false.
+            if (isLoaded || loader != NULL){
+                logger.warning << "The LOD mode can't be changed after the heightmap is loaded" << logger.end;
+                return;
+            }
+            lodMode = mode;
         }
 
         // **** inline functions ****
 
+        void HeightMapNode::LoadSource(){
+            if (ucharSource != NULL) ucharSource->Load();
+            else if (ushortSource != NULL) ushortSource->Load();
+            else tex->Load();
+        }
+
+        /**
+         * Samples every step'th source height into a w * d grid of
+         * vertices.
+         */
+        template <class T>
+        static void SamplePlaceholder(Texture2DPtr(T) src, int step, int w, int d,
+                                      float heightScale, float widthScale, 
+                                      Vector<3, float> offset, float* vertices){
+            const T* data = src->GetData();
+            int srcWidth = src->GetWidth();
+            int srcHeight = src->GetHeight();
+            int channels = src->GetChannels();
+            for (int x = 0; x < w; ++x)
+                for (int z = 0; z < d; ++z){
+                    int sx = std::min(x * step, srcWidth - 1);
+                    int sz = std::min(z * step, srcHeight - 1);
+                    float* v = vertices + (z + x * d) * 3;
+                    v[0] = widthScale * sx + offset[0];
+                    v[1] = data[(sx + sz * srcWidth) * channels] * heightScale + offset[1];
+                    v[2] = widthScale * sz + offset[2];
+                }
+        }
+
+        void HeightMapNode::SetupPlaceholder(){
+            const int PLACEHOLDER_SIZE = 64;
+
+            ITexture2DPtr source;
+            if (ucharSource != NULL) source = ucharSource;
+            else if (ushortSource != NULL) source = ushortSource;
+            else source = tex;
+            int srcWidth = source->GetWidth();
+            int srcHeight = source->GetHeight();
+            int step = std::max(srcWidth, srcHeight) / PLACEHOLDER_SIZE;
+            if (step < 1) step = 1;
+            int w = (srcWidth - 1) / step + 2;
+            int d = (srcHeight - 1) / step + 2;
+
+            float* vertices = new float[w * d * 3];
+            float* vertexNormals = new float[w * d * 3];
+            if (ucharSource != NULL)
+                SamplePlaceholder(ucharSource, step, w, d, heightScale, widthScale, offset, vertices);
+            else if (ushortSource != NULL)
+                SamplePlaceholder(ushortSource, step, w, d, heightScale, widthScale, offset, vertices);
+            else
+                SamplePlaceholder(tex, step, w, d, heightScale, widthScale, offset, vertices);
+
+            // Central difference normals
+            for (int x = 0; x < w; ++x)
+                for (int z = 0; z < d; ++z){
+                    float* l = vertices + (z + std::max(x - 1, 0) * d) * 3;
+                    float* r = vertices + (z + std::min(x + 1, w - 1) * d) * 3;
+                    float* b = vertices + (std::max(z - 1, 0) + x * d) * 3;
+                    float* a = vertices + (std::min(z + 1, d - 1) + x * d) * 3;
+                    Vector<3, float> normal(l[1] - r[1], 2.0f * step * widthScale, b[1] - a[1]);
+                    normal.Normalize();
+                    normal.ToArray(vertexNormals + (z + x * d) * 3);
+                }
+
+            loadMutex.Lock();
+            placeholderWidth = w;
+            placeholderDepth = d;
+            placeholderVertices = vertices;
+            placeholderNormals = vertexNormals;
+            placeholderReady = true;
+            loadMutex.Unlock();
+        }
+
+        void HeightMapNode::BackgroundLoad(){
+            LoadSource();
+            SetupPlaceholder();
+
+            Load();
+
+            loadMutex.Lock();
+            loadFinished = true;
+            loadMutex.Unlock();
+        }
+
         void HeightMapNode::InitArrays(){
-            int texWidth = tex->GetHeight();
-            int texDepth = tex->GetWidth();
+            ITexture2DPtr source;
+            if (ucharSource != NULL) source = ucharSource;
+            else if (ushortSource != NULL) source = ushortSource;
+            else source = tex;
+            int texWidth = source->GetHeight();
+            int texDepth = source->GetWidth();
 
             // if texwidth/depth isn't expressible as n * patchwidth + 1 fix it.
             int patchWidth = HeightMapPatch::PATCH_EDGE_SQUARES;
@@ -527,47 +942,64 @@ namespace OpenEngine {
             depth = depthRest ? texDepth + patchWidth - depthRest : texDepth;
 
             unsigned int numberOfVertices = width * depth;
+            SetupLODLevels();
+
+            Utils::Timer timer;
+            timer.Start();
+
+            // Scale the heights directly into the padded heightmap,
+            // releasing the 8 and 16 bit sources.
+            if (ucharSource != NULL){
+                tex = ImportHeightMap(ucharSource, width, depth, heightScale, offset[1]);
+                ucharSource.reset();
+            }else if (ushortSource != NULL){
+                tex = ImportHeightMap(ushortSource, width, depth, heightScale, offset[1]);
+                ushortSource.reset();
+            }else
+                tex = ImportHeightMap(tex, width, depth, heightScale, offset[1]);
+            const float* heights = tex->GetData();
+            loadTimes[IMPORT_PHASE] = timer.GetElapsedIntervals(1);
 
-            Texture2D<float>* newTex = new Texture2D<float>(width, depth, LUMINANCE32F);
-            newTex->SetWrapping(CLAMP_TO_EDGE);
-            newTex->Load();
-            for (int x = 0; x < width; ++x){
-                for (int z = 0; z < depth; ++z){
-                    if (x < texWidth && z < texDepth){
-                        // inside the heightmap
-                        newTex->GetPixel(x, z)[0] = tex->GetPixel(x, z)[0] * heightScale + offset[1];
-                    }else{
-                        // outside the heightmap, set height to waterlevel
-                        newTex->GetPixel(x, z)[0] = offset[1];
-                    }
-                }
-            }
-
-            tex = FloatTexture2DPtr(newTex);
-
+            timer.Reset();
+            timer.Start();
             vertexBuffer = Float4DataBlockPtr(new DataBlock<4, float>(numberOfVertices));
             vertexBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
             normals = new float[numberOfVertices * 3];
             normalMapCoordBuffer = Float2DataBlockPtr(new DataBlock<2, float>(numberOfVertices));
             geomorphBuffer = Float3DataBlockPtr(new DataBlock<3, float>(numberOfVertices));
-            deltaValues = new char[numberOfVertices];
+            deltaValues = new unsigned short[numberOfVertices];
 
             // Fill the vertex array
+#pragma omp parallel for
             for (int x = 0; x < width; ++x){
                 for (int z = 0; z < depth; ++z){
                     float* vertice = GetVertice(x, z);
                      
                     vertice[0] = widthScale * x + offset[0];
-                    vertice[1] = newTex->GetPixel(x, z)[0];
+                    vertice[1] = heights[x + z * width];
                     vertice[2] = widthScale * z + offset[2];
                     vertice[3] = 1;
                 }
             }
 
+            loadTimes[VERTEX_PHASE] = timer.GetElapsedIntervals(1);
+
+            timer.Reset();
+            timer.Start();
             SetupNormalMap();
+            loadTimes[NORMAL_PHASE] = timer.GetElapsedIntervals(1);
 
             if (landscapeShader != NULL){
+                timer.Reset();
+                timer.Start();
                 CalcVerticeLOD();
+                loadTimes[LOD_PHASE] = timer.GetElapsedIntervals(1);
+
+                // The geomorph heights only read the y-coord of the
+                // vertices, so the rows can be computed in parallel.
+                timer.Reset();
+                timer.Start();
+#pragma omp parallel for
                 for (int x = 0; x < width; ++x)
                     for (int z = 0; z < depth; ++z){
                         // Store the morphing value in the w-coord to
@@ -575,10 +1007,12 @@ namespace OpenEngine {
                         float* vertice = GetVertice(x, z);
                         vertice[3] = CalcGeomorphHeight(x, z);
                     }
+                loadTimes[GEOMORPH_PHASE] = timer.GetElapsedIntervals(1);
             }
         }
 
         void HeightMapNode::SetupNormalMap(){
+#pragma omp parallel for
             for (int x = 0; x < width; ++x)
                 for (int z = 0; z < depth; ++z){
                     float* coord = GetNormalMapCoord(x, z);
@@ -589,14 +1023,110 @@ namespace OpenEngine {
                 }
         }
 
+        // The horizon map directions {x, z}, 45 degrees apart.
+        static const int HORIZON_DIRECTIONS[HeightMapNode::HORIZON_AZIMUTHS][2] = 
+            {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+
+        unsigned char HeightMapNode::ComputeHorizon(const int x, const int z, const int azimuth) const{
+            int dx = HORIZON_DIRECTIONS[azimuth][0];
+            int dz = HORIZON_DIRECTIONS[azimuth][1];
+            float stepLength = (dx != 0 && dz != 0 ? sqrt(2.0f) : 1.0f) * widthScale;
+            float height = GetVertice(x, z)[1];
+
+            // Far terrain only matters if it is much higher, so the
+            // steps grow with the distance.
+            float maxSlope = 0.0f;
+            for (int k = 1; k <= horizonDistance; k += 1 + k / 8){
+                int xi = x + dx * k, zi = z + dz * k;
+                if (xi < 0 || xi >= width || zi < 0 || zi >= depth) break;
+                float slope = (GetVertice(xi, zi)[1] - height) / (k * stepLength);
+                if (slope > maxSlope) maxSlope = slope;
+            }
+            float sine = maxSlope / sqrt(1.0f + maxSlope * maxSlope);
+            return (unsigned char)(sine * 255.0f + 0.5f);
+        }
+
+        void HeightMapNode::UpdateHorizonMaps(const int xStart, const int zStart, const int xEnd, const int zEnd){
+            // The horizon of a vertex in direction d changes if a
+            // changed vertex lies k * d away, for k from 0 to the
+            // horizon distance.
+            int xLow = std::max(xStart - horizonDistance, 0);
+            int xHigh = std::min(xEnd + horizonDistance, width);
+            int zLow = std::max(zStart - horizonDistance, 0);
+            int zHigh = std::min(zEnd + horizonDistance, depth);
+            unsigned char* maps[2] = { horizonMaps[0]->GetData(), horizonMaps[1]->GetData() };
+
+#pragma omp parallel for
+            for (int x = xLow; x < xHigh; ++x)
+                for (int z = zLow; z < zHigh; ++z){
+                    int index = CoordToIndex(x, z) * 4;
+                    for (int a = 0; a < HORIZON_AZIMUTHS; ++a){
+                        int dx = HORIZON_DIRECTIONS[a][0];
+                        int dz = HORIZON_DIRECTIONS[a][1];
+                        int kLow = 0, kHigh = horizonDistance;
+                        if (dx == 0){
+                            if (x < xStart || x >= xEnd) continue;
+                        }else{
+                            int k0 = (xStart - x) * dx, k1 = (xEnd - 1 - x) * dx;
+                            kLow = std::max(kLow, std::min(k0, k1));
+                            kHigh = std::min(kHigh, std::max(k0, k1));
+                        }
+                        if (dz == 0){
+                            if (z < zStart || z >= zEnd) continue;
+                        }else{
+                            int k0 = (zStart - z) * dz, k1 = (zEnd - 1 - z) * dz;
+                            kLow = std::max(kLow, std::min(k0, k1));
+                            kHigh = std::min(kHigh, std::max(k0, k1));
+                        }
+                        if (kLow > kHigh) continue;
+
+                        maps[a / 4][index + a % 4] = ComputeHorizon(x, z, a);
+                    }
+                }
+
+            // Upload the changed region if the maps are loaded.
+            if (horizonMaps[0]->GetID() == 0) return;
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, depth);
+            for (int i = 0; i < 2; ++i){
+                glBindTexture(GL_TEXTURE_2D, horizonMaps[i]->GetID());
+                glTexSubImage2D(GL_TEXTURE_2D, 0, zLow, xLow, 
+                                zHigh - zLow, xHigh - xLow, 
+                                GL_RGBA, GL_UNSIGNED_BYTE, maps[i] + CoordToIndex(xLow, zLow) * 4);
+            }
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        }
+
+        void HeightMapNode::SetupLODLevels(){
+            // The quadtree levels reuse the vertex LODs, so the
+            // vertices need a level above the top of the tree to
+            // morph towards. A 16 bit delta allows 15 tree levels,
+            // half a million squares across.
+            maxLOD = HeightMapPatch::MAX_LODS;
+            if (lodMode == QUADTREE_LOD){
+                int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+                int levels = HeightMapQuadTree::CalcLevels((width-1) / squares, (depth-1) / squares);
+                maxLOD = std::max(maxLOD, levels + 1);
+            }
+            maxDelta = 1 << (maxLOD - 1);
+        }
+
         void HeightMapNode::CalcVerticeLOD(){
-            for (int LOD = 1; LOD <= HeightMapPatch::MAX_LODS; ++LOD){
-                int delta = pow(2, LOD-1);
-                for (int x = 0; x < width; x += delta){
-                    for (int z = 0; z < depth; z += delta){
-                        GetVerticeLOD(x, z) = LOD;
-                        GetVerticeDelta(x, z) = pow(2, LOD-1);
+            // Each vertex gets the highest LOD it is part of. Rows
+            // are independent, so compute them in parallel and let
+            // each vertex pick its LOD directly.
+#pragma omp parallel for
+            for (int x = 0; x < width; ++x){
+                for (int z = 0; z < depth; ++z){
+                    int LOD = 1;
+                    int delta = 1;
+                    while (LOD < maxLOD && 
+                           x % (delta * 2) == 0 && z % (delta * 2) == 0){
+                        ++LOD;
+                        delta *= 2;
                     }
+                    GetVerticeLOD(x, z) = LOD;
+                    GetVerticeDelta(x, z) = delta;
                 }
             }
         }
@@ -605,16 +1135,21 @@ namespace OpenEngine {
             if (landscapeShader == NULL)
                 return 1.0f;
             else{
-                short delta = GetVerticeDelta(x, z);
+                int delta = GetVerticeDelta(x, z);
                 
                 int dx, dz;
-                if (delta < HeightMapPatch::MAX_DELTA){
+                if (delta < maxDelta){
                     dx = x % (delta * 2);
                     dz = z % (delta * 2);
                 }else{
                     dx = 0;
                     dz = 0;
                 }
+                // Coarse levels may step past the edge of the map.
+                if (x + dx >= width || z + dz >= depth){
+                    dx = 0;
+                    dz = 0;
+                }
                 
                 float* vertice = GetVertice(x, z);
                 float* verticeNeighbour1 = GetVertice(x + dx, z + dz);
@@ -653,46 +1188,54 @@ namespace OpenEngine {
             patchGridDepth = (depth-1) / squares;
             numberOfPatches = patchGridWidth * patchGridDepth;
             patchNodes = new HeightMapPatch*[numberOfPatches];
-            int entry = 0;
-            for (int x = 0; x < width - squares; x +=squares ){
-                for (int z = 0; z < depth - squares; z += squares){
-                    patchNodes[entry++] = new HeightMapPatch(x, z, this);
-                }
+#pragma omp parallel for schedule(dynamic)
+            for (int p = 0; p < numberOfPatches; ++p){
+                int x = (p / patchGridDepth) * squares;
+                int z = (p % patchGridDepth) * squares;
+                patchNodes[p] = new HeightMapPatch(x, z, this);
             }
 
-            // Setup indice buffer
+            // Setup indice buffer. The offsets are assigned serially,
+            // the indices are then copied in parallel.
             unsigned int numberOfIndices = 0;
+            unsigned int* patchOffsets = new unsigned int[numberOfPatches];
             for (int p = 0; p < numberOfPatches; ++p){
-                for (int l = 0; l < HeightMapPatch::MAX_LODS; ++l){
-                    for (int rl = 0; rl < 3; ++rl){
-                        for (int ul = 0; ul < 3; ++ul){
-                            LODstruct& lod = patchNodes[p]->GetLodStruct(l,rl,ul);
-                            lod.indiceBufferOffset = numberOfIndices;
-                            numberOfIndices += lod.numberOfIndices;
-                        }
-                    }
+                patchOffsets[p] = numberOfIndices;
+                for (int r = 0; r < HeightMapPatch::INDEX_RANGES; ++r){
+                    LODstruct& lod = patchNodes[p]->GetLodStruct(r);
+                    lod.indiceBufferOffset = numberOfIndices;
+                    numberOfIndices += lod.numberOfIndices;
                 }
             }
 
             indexBuffer = IndicesPtr(new Indices(numberOfIndices));
             unsigned int* indices = indexBuffer->GetData();
 
-            unsigned int i = 0;
+#pragma omp parallel for
             for (int p = 0; p < numberOfPatches; ++p){
+                unsigned int i = patchOffsets[p];
                 patchNodes[p]->SetDataIndices(indexBuffer);
-                for (int l = 0; l < HeightMapPatch::MAX_LODS; ++l){
-                    for (int rl = 0; rl < 3; ++rl){
-                        for (int ul = 0; ul < 3; ++ul){
-                            LODstruct& lod = patchNodes[p]->GetLodStruct(l,rl,ul);
-                            memcpy(indices + i, lod.indices, sizeof(unsigned int) * lod.numberOfIndices);
-                            i += lod.numberOfIndices;
-                        }
-                    }
+                for (int r = 0; r < HeightMapPatch::INDEX_RANGES; ++r){
+                    LODstruct& lod = patchNodes[p]->GetLodStruct(r);
+                    memcpy(indices + i, lod.indices, sizeof(unsigned int) * lod.numberOfIndices);
+                    i += lod.numberOfIndices;
                 }
             }
+            delete [] patchOffsets;
 
-            // Setup shader uniforms used in geomorphing
-            if (landscapeShader != NULL){
+            // Setup shader uniforms used in geomorphing. The quadtree
+            // morphs from the distance to each vertex.
+            if (landscapeShader != NULL && lodMode == QUADTREE_LOD){
+#pragma omp parallel for
+                for (int x = 0; x < width; ++x)
+                    for (int z = 0; z < depth; ++z){
+                        float* vertice = GetVertice(x, z);
+                        float* geomorph = GetGeomorphValues(x, z);
+                        geomorph[0] = vertice[0];
+                        geomorph[1] = vertice[2];
+                    }
+            }else if (landscapeShader != NULL){
+#pragma omp parallel for
                 for (int x = 0; x < width - 1; ++x){
                     for (int z = 0; z < depth - 1; ++z){
                         HeightMapPatch* patch = GetPatch(x, z);
@@ -704,6 +1247,429 @@ namespace OpenEngine {
             }
         }
         
+        void HeightMapNode::SetupQuadTree(){
+            if (lodMode != QUADTREE_LOD) return;
+            quadtree = new HeightMapQuadTree(this, patchNodes, patchGridWidth, patchGridDepth);
+            // The patches keep their own indices for the bounds, but
+            // only the quadtree's are rendered.
+            indexBuffer = quadtree->GetIndices();
+        }
+
+        void HeightMapNode::UpdateNeighbourLODs(HeightMapLODState& state) const{
+            // The LODs depend on more than the patch positions, so
+            // stitch to the LODs the neighbours actually selected.
+            // Upper is along the x-axis, right along the z-axis.
+            for (int x = 0; x < patchGridWidth; ++x)
+                for (int z = 0; z < patchGridDepth; ++z){
+                    PatchLODState& patch = state.patches[z + x * patchGridDepth];
+                    patch.upperLOD = x + 1 < patchGridWidth ? state.patches[z + (x+1) * patchGridDepth].LOD : patch.LOD;
+                    patch.rightLOD = z + 1 < patchGridDepth ? state.patches[z+1 + x * patchGridDepth].LOD : patch.LOD;
+                }
+        }
+
+        void HeightMapNode::UpdateLODBudget(){
+            // The load is the largest ratio of count to budget. The
+            // patches are all drawn with one call each, so only the
+            // quadtree draw calls depend on the distances.
+            float load = 0.0f;
+            if (triangleBudget > 0)
+                load = lodState.triangleCount / float(triangleBudget);
+            if (drawCallBudget > 0 && quadtree != NULL)
+                load = std::max(load, lodState.drawCallCount / float(drawCallBudget));
+            // Nothing visible or within 5% of the budget.
+            if (load <= 0.0f || fabs(load - 1.0f) < 0.05f) return;
+
+            // A larger pixel error coarsens the terrain, larger
+            // distances refine it.
+            if (lodState.errorScale > 0){
+                float correction = pow(load, 0.5f * budgetSmoothing);
+                pixelError *= correction < 0.5f ? 0.5f : (correction > 2.0f ? 2.0f : correction);
+                return;
+            }
+
+            float correction = pow(load, -0.5f * budgetSmoothing);
+            correction = correction < 0.5f ? 0.5f : (correction > 2.0f ? 2.0f : correction);
+
+            // When shrinking stay above the lowest distance
+            // SetLODSwitchDistance accepts, so it doesn't complain
+            // every frame.
+            float edgeLength = HeightMapPatch::PATCH_EDGE_SQUARES * widthScale;
+            float minInc = lodMode == QUADTREE_LOD ? edgeLength * 1.415f : widthScale;
+            float inc = 1.0f / invIncDistance;
+            if (correction < 1.0f && inc * correction < minInc){
+                if (inc <= minInc) return;
+                correction = minInc / inc;
+            }
+            SetLODSwitchDistance(baseDistance * correction, inc * correction);
+        }
+
+        /**
+         * Sorts the values by their keys with a least significant
+         * digit radix sort, skipping the digits all keys share.
+         */
+        static void RadixSort(std::vector<unsigned int>& keys, std::vector<int>& values){
+            unsigned int n = keys.size();
+            std::vector<unsigned int> sortedKeys(n);
+            std::vector<int> sortedValues(n);
+            for (int shift = 0; shift < 32; shift += 8){
+                unsigned int offsets[256];
+                memset(offsets, 0, sizeof(offsets));
+                for (unsigned int i = 0; i < n; ++i)
+                    ++offsets[(keys[i] >> shift) & 0xFF];
+                if (n == 0 || offsets[(keys[0] >> shift) & 0xFF] == n) continue;
+
+                unsigned int sum = 0;
+                for (int d = 0; d < 256; ++d){
+                    unsigned int count = offsets[d];
+                    offsets[d] = sum;
+                    sum += count;
+                }
+                for (unsigned int i = 0; i < n; ++i){
+                    unsigned int o = offsets[(keys[i] >> shift) & 0xFF]++;
+                    sortedKeys[o] = keys[i];
+                    sortedValues[o] = values[i];
+                }
+                keys.swap(sortedKeys);
+                values.swap(sortedValues);
+            }
+        }
+
+        void HeightMapNode::UpdateDrawOrder(Vector<3, float> viewPos, HeightMapLODState& state) const{
+            // The distances only depend on the view position, so the
+            // patches are only sorted again when it changes.
+            if (!state.sortValid || state.sortViewPos != viewPos || state.sortHeightVersion != heightVersion ||
+                (int)state.sortedPatches.size() != numberOfPatches){
+                std::vector<unsigned int> keys(numberOfPatches);
+                state.sortedPatches.resize(numberOfPatches);
+                for (int i = 0; i < numberOfPatches; ++i){
+                    // Positive floats order like their bits.
+                    float distance = patchNodes[i]->GetDistanceSquared(viewPos);
+                    memcpy(&keys[i], &distance, sizeof(float));
+                    state.sortedPatches[i] = i;
+                }
+                RadixSort(keys, state.sortedPatches);
+                state.sortViewPos = viewPos;
+                state.sortHeightVersion = heightVersion;
+                state.sortValid = true;
+                ++state.sorts;
+            }
+
+            state.drawOrder.clear();
+            for (unsigned int i = 0; i < state.sortedPatches.size(); ++i)
+                if (state.patches[state.sortedPatches[i]].visible)
+                    state.drawOrder.push_back(state.sortedPatches[i]);
+        }
+
+        /**
+         * A horizon update or test, see ComputeOcclusion.
+         */
+        struct OcclusionEvent {
+            float distance;
+            int patch;
+            int cell; // -1 to test the patch
+            float first, last, nearest, farthest;
+            bool operator<(const OcclusionEvent& e) const {
+                // Raise the horizon before testing at the same
+                // distance.
+                return distance < e.distance || (distance == e.distance && cell > e.cell);
+            }
+        };
+
+        /**
+         * The azimuths of the rectangle [x0, x1] x [z0, z1] seen from
+         * the view position, in bins, and its closest and farthest
+         * horizontal distance.
+         *
+         * @return False if the view is above the rectangle.
+         */
+        static bool GetAzimuthSpan(const Vector<3, float>& viewPos, const float* lower, const float* upper,
+                                   float binsPerRadian, OcclusionEvent& e){
+            float x0 = lower[0], z0 = lower[2], x1 = upper[0], z1 = upper[2];
+            float dx = viewPos[0] < x0 ? x0 - viewPos[0] : (viewPos[0] > x1 ? viewPos[0] - x1 : 0.0f);
+            float dz = viewPos[2] < z0 ? z0 - viewPos[2] : (viewPos[2] > z1 ? viewPos[2] - z1 : 0.0f);
+            if (dx == 0.0f && dz == 0.0f) return false;
+            e.nearest = sqrt(dx * dx + dz * dz);
+
+            // The corner azimuths relative to the center are within
+            // half a turn when the view is outside.
+            float center = atan2(z0 + z1 - 2.0f * viewPos[2], x0 + x1 - 2.0f * viewPos[0]);
+            float lowest = 0.0f, highest = 0.0f;
+            e.farthest = 0.0f;
+            for (int c = 0; c < 4; ++c){
+                float cx = (c & 1 ? x1 : x0) - viewPos[0];
+                float cz = (c & 2 ? z1 : z0) - viewPos[2];
+                float a = atan2(cz, cx) - center;
+                if (a > Math::PI) a -= 2.0f * Math::PI;
+                else if (a < -Math::PI) a += 2.0f * Math::PI;
+                lowest = a < lowest ? a : lowest;
+                highest = a > highest ? a : highest;
+                float d = sqrt(cx * cx + cz * cz);
+                e.farthest = d > e.farthest ? d : e.farthest;
+            }
+            e.first = (center + lowest + Math::PI) * binsPerRadian;
+            e.last = (center + highest + Math::PI) * binsPerRadian;
+            return true;
+        }
+
+        void HeightMapNode::ComputeOcclusion(Vector<3, float> viewPos, const std::vector<int>& candidates,
+                                             const HeightMapLODState& state, std::vector<float>& horizon,
+                                             std::vector<int>& occluded) const{
+            // A ray through a cell is below its lowest height
+            // somewhere if its rise over run is below that height at
+            // the far side, or the near side if the cell is below the
+            // view. Raising the horizon by the cells no farther away
+            // than the nearest point of a patch, every ray to the
+            // patch below the horizon is blocked before reaching it.
+            int bins = horizon.size();
+            float binsPerRadian = bins / (2.0f * Math::PI);
+            for (int b = 0; b < bins; ++b)
+                horizon[b] = -FLT_MAX;
+
+            const int cells = HeightMapPatch::OCCLUDER_CELLS;
+            const int squares = HeightMapPatch::OCCLUDER_CELL_SQUARES;
+            const int edge = HeightMapPatch::PATCH_EDGE_SQUARES;
+            std::vector<OcclusionEvent> events;
+            events.reserve(candidates.size() * (1 + cells * cells));
+            for (unsigned int i = 0; i < candidates.size(); ++i){
+                HeightMapPatch* patch = patchNodes[candidates[i]];
+                int xStart = patch->GetXStart(), zStart = patch->GetZStart();
+                OcclusionEvent e;
+                e.patch = candidates[i];
+                // The patch below the view is never culled.
+                e.cell = -1;
+                if (GetAzimuthSpan(viewPos, GetVertice(xStart, zStart), GetVertice(xStart + edge, zStart + edge),
+                                   binsPerRadian, e)){
+                    e.distance = e.nearest;
+                    events.push_back(e);
+                }
+
+                for (int c = 0; c < cells * cells; ++c){
+                    int x = xStart + (c / cells) * squares;
+                    int z = zStart + (c % cells) * squares;
+                    e.cell = c;
+                    if (GetAzimuthSpan(viewPos, GetVertice(x, z), GetVertice(x + squares, z + squares),
+                                       binsPerRadian, e)){
+                        e.distance = e.farthest;
+                        events.push_back(e);
+                    }
+                }
+            }
+            std::sort(events.begin(), events.end());
+
+            for (unsigned int i = 0; i < events.size(); ++i){
+                const OcclusionEvent& e = events[i];
+                HeightMapPatch* patch = patchNodes[e.patch];
+                // The coarser LODs may draw the surface a bit off the
+                // vertices.
+                float error = patch->GetLODError(state.patches[e.patch].LOD);
+                if (e.cell == -1){
+                    // The steepest ray to the patch, tested against
+                    // every bin it touches.
+                    float rise = patch->GetMaxHeight() + error - viewPos[1];
+                    float slope = rise / (rise > 0.0f ? e.nearest : e.farthest);
+                    bool hidden = true;
+                    for (int b = int(floor(e.first)); b <= int(floor(e.last)) && hidden; ++b)
+                        hidden = horizon[(b % bins + bins) % bins] > slope;
+                    if (hidden) occluded.push_back(e.patch);
+                }else{
+                    // The shallowest blocked ray, raising only the
+                    // bins entirely covered by the cell.
+                    float rise = patch->GetOccluderHeight(e.cell / cells, e.cell % cells) - error - viewPos[1];
+                    float slope = rise / (rise > 0.0f ? e.farthest : e.nearest);
+                    for (int b = int(ceil(e.first)); b + 1 <= e.last; ++b){
+                        float& h = horizon[(b % bins + bins) % bins];
+                        h = slope > h ? slope : h;
+                    }
+                }
+            }
+        }
+
+        bool HeightMapNode::IsVertexVisible(Vector<3, float> viewPos, int x, int z) const{
+            // March along the ray in quarter squares, stopping short
+            // of the vertex itself.
+            float* target = GetVertice(x, z);
+            float dx = target[0] - viewPos[0];
+            float dy = target[1] - viewPos[1];
+            float dz = target[2] - viewPos[2];
+            int steps = int(sqrt(dx * dx + dz * dz) / (0.25f * widthScale)) + 1;
+            for (int s = 1; s < steps; ++s){
+                float t = s / float(steps);
+                float px = viewPos[0] + t * dx;
+                float pz = viewPos[2] + t * dz;
+                float gx = (px - offset[0]) / widthScale;
+                float gz = (pz - offset[2]) / widthScale;
+                if (gx < 0.0f || gz < 0.0f || gx >= width - 1 || gz >= depth - 1) continue;
+                if (GetHeight(px, pz) > viewPos[1] + t * dy)
+                    return false;
+            }
+            return true;
+        }
+
+        unsigned long long HeightMapNode::CacheHash() const{
+            // Hash the source heights and every setting affecting the
+            // precomputed data.
+            unsigned long long hash = TerrainCache::Hash(NULL, 0);
+            ITexture2DPtr source;
+            if (ucharSource != NULL){
+                source = ucharSource;
+                hash = TerrainCache::Hash(ucharSource->GetData(), 
+                                          sizeof(unsigned char) * source->GetWidth() * source->GetHeight() * source->GetChannels(), hash);
+            }else if (ushortSource != NULL){
+                source = ushortSource;
+                hash = TerrainCache::Hash(ushortSource->GetData(), 
+                                          sizeof(unsigned short) * source->GetWidth() * source->GetHeight() * source->GetChannels(), hash);
+            }else{
+                source = tex;
+                hash = TerrainCache::Hash(tex->GetData(), 
+                                          sizeof(float) * source->GetWidth() * source->GetHeight() * source->GetChannels(), hash);
+            }
+
+            int layout[7] = { (int)source->GetWidth(), (int)source->GetHeight(), (int)source->GetChannels(),
+                              HeightMapPatch::PATCH_EDGE_SQUARES, HeightMapPatch::MAX_LODS,
+                              landscapeShader != NULL, lodMode };
+            hash = TerrainCache::Hash(layout, sizeof(layout), hash);
+            float scales[5] = { heightScale, widthScale, offset[0], offset[1], offset[2] };
+            return TerrainCache::Hash(scales, sizeof(scales), hash);
+        }
+
+        bool HeightMapNode::LoadCache(unsigned long long hash){
+            TerrainCachePtr mapped = TerrainCachePtr(new TerrainCache());
+            if (!mapped->Open(cacheFile)) return false;
+
+            const TerrainCache::Header& header = mapped->GetHeader();
+            if (header.hash != hash){
+                logger.info << "Terrain cache " << cacheFile << " is stale, recomputing" << logger.end;
+                return false;
+            }
+
+            width = header.width;
+            depth = header.depth;
+            patchGridWidth = header.patchGridWidth;
+            patchGridDepth = header.patchGridDepth;
+            numberOfPatches = patchGridWidth * patchGridDepth;
+            SetupLODLevels();
+            unsigned long long numberOfVertices = width * depth;
+            unsigned long long numberOfIndices = mapped->GetSectionSize(TerrainCache::INDICES) / sizeof(unsigned int);
+
+            if (mapped->GetSectionSize(TerrainCache::HEIGHTS) != numberOfVertices * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::VERTICES) != numberOfVertices * DIMENSIONS * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::NORMALS) != numberOfVertices * 3 * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::NORMALMAP_COORDS) != numberOfVertices * TEXCOORDS * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::GEOMORPH) != numberOfVertices * 3 * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::DELTAS) != numberOfVertices * sizeof(unsigned short) ||
+                mapped->GetSectionSize(TerrainCache::PATCH_BOUNDS) != numberOfPatches * 2 * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::PATCH_ERRORS) != numberOfPatches * HeightMapPatch::MAX_LODS * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::PATCH_OCCLUDERS) != numberOfPatches * HeightMapPatch::OCCLUDER_CELLS * HeightMapPatch::OCCLUDER_CELLS * sizeof(float) ||
+                mapped->GetSectionSize(TerrainCache::PATCH_LODS) != numberOfPatches * HeightMapPatch::INDEX_RANGES * 2 * sizeof(unsigned int)){
+                logger.warning << "Terrain cache " << cacheFile << " is corrupt, recomputing" << logger.end;
+                return false;
+            }
+
+            // The buffers point straight into the mapping, so pages
+            // are only read when used and SetVertex copies the pages
+            // it writes to.
+            tex = FloatTexture2DPtr(new MappedTexture2D(width, depth, mapped->GetSection(TerrainCache::HEIGHTS), mapped));
+            tex->SetColorFormat(LUMINANCE32F);
+            tex->SetWrapping(CLAMP_TO_EDGE);
+            ucharSource.reset();
+            ushortSource.reset();
+
+            vertexBuffer = Float4DataBlockPtr(new MappedDataBlock<4, float>(numberOfVertices, mapped->GetSection(TerrainCache::VERTICES), mapped));
+            vertexBuffer->SetUnloadPolicy(UNLOAD_EXPLICIT);
+            normals = (float*)mapped->GetSection(TerrainCache::NORMALS);
+            normalMapCoordBuffer = Float2DataBlockPtr(new MappedDataBlock<2, float>(numberOfVertices, mapped->GetSection(TerrainCache::NORMALMAP_COORDS), mapped));
+            geomorphBuffer = Float3DataBlockPtr(new MappedDataBlock<3, float>(numberOfVertices, mapped->GetSection(TerrainCache::GEOMORPH), mapped));
+            deltaValues = (unsigned short*)mapped->GetSection(TerrainCache::DELTAS);
+
+            indexBuffer = IndicesPtr(new MappedIndices(numberOfIndices, mapped->GetSection(TerrainCache::INDICES), mapped));
+
+            const float* bounds = (const float*)mapped->GetSection(TerrainCache::PATCH_BOUNDS);
+            const float* errors = (const float*)mapped->GetSection(TerrainCache::PATCH_ERRORS);
+            const float* occluders = (const float*)mapped->GetSection(TerrainCache::PATCH_OCCLUDERS);
+            const int occluderCells = HeightMapPatch::OCCLUDER_CELLS * HeightMapPatch::OCCLUDER_CELLS;
+            const unsigned int* lodTable = (const unsigned int*)mapped->GetSection(TerrainCache::PATCH_LODS);
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            patchNodes = new HeightMapPatch*[numberOfPatches];
+            int entry = 0;
+            for (int x = 0; x < width - squares; x +=squares ){
+                for (int z = 0; z < depth - squares; z += squares){
+                    patchNodes[entry] = new HeightMapPatch(x, z, this, bounds[2 * entry], bounds[2 * entry + 1],
+                                                           errors + entry * HeightMapPatch::MAX_LODS,
+                                                           occluders + entry * occluderCells,
+                                                           lodTable + entry * HeightMapPatch::INDEX_RANGES * 2, 
+                                                           indexBuffer);
+                    ++entry;
+                }
+            }
+
+            cache = mapped;
+            return true;
+        }
+
+        void HeightMapNode::SaveCache(unsigned long long hash){
+            unsigned int numberOfVertices = width * depth;
+
+            float* bounds = new float[numberOfPatches * 2];
+            float* errors = new float[numberOfPatches * HeightMapPatch::MAX_LODS];
+            const int occluderCells = HeightMapPatch::OCCLUDER_CELLS * HeightMapPatch::OCCLUDER_CELLS;
+            float* occluders = new float[numberOfPatches * occluderCells];
+            unsigned int* lodTable = new unsigned int[numberOfPatches * HeightMapPatch::INDEX_RANGES * 2];
+            for (int p = 0; p < numberOfPatches; ++p){
+                bounds[2 * p] = patchNodes[p]->GetMinHeight();
+                bounds[2 * p + 1] = patchNodes[p]->GetMaxHeight();
+                for (int l = 0; l < HeightMapPatch::MAX_LODS; ++l)
+                    errors[p * HeightMapPatch::MAX_LODS + l] = patchNodes[p]->GetMaxError(l);
+                for (int c = 0; c < occluderCells; ++c)
+                    occluders[p * occluderCells + c] = 
+                        patchNodes[p]->GetOccluderHeight(c / HeightMapPatch::OCCLUDER_CELLS, c % HeightMapPatch::OCCLUDER_CELLS);
+                unsigned int* entry = lodTable + p * HeightMapPatch::INDEX_RANGES * 2;
+                for (int r = 0; r < HeightMapPatch::INDEX_RANGES; ++r){
+                    LODstruct& lod = patchNodes[p]->GetLodStruct(r);
+                    *entry++ = lod.numberOfIndices;
+                    *entry++ = lod.indiceBufferOffset;
+                }
+            }
+
+            TerrainCache::Header header;
+            memset(&header, 0, sizeof(header));
+            header.hash = hash;
+            header.width = width;
+            header.depth = depth;
+            header.patchGridWidth = patchGridWidth;
+            header.patchGridDepth = patchGridDepth;
+
+            const void* sections[TerrainCache::SECTIONS];
+            sections[TerrainCache::HEIGHTS] = tex->GetData();
+            header.sizes[TerrainCache::HEIGHTS] = numberOfVertices * sizeof(float);
+            sections[TerrainCache::VERTICES] = vertexBuffer->GetData();
+            header.sizes[TerrainCache::VERTICES] = numberOfVertices * DIMENSIONS * sizeof(float);
+            sections[TerrainCache::NORMALS] = normals;
+            header.sizes[TerrainCache::NORMALS] = numberOfVertices * 3 * sizeof(float);
+            sections[TerrainCache::NORMALMAP_COORDS] = normalMapCoordBuffer->GetData();
+            header.sizes[TerrainCache::NORMALMAP_COORDS] = numberOfVertices * TEXCOORDS * sizeof(float);
+            sections[TerrainCache::GEOMORPH] = geomorphBuffer->GetData();
+            header.sizes[TerrainCache::GEOMORPH] = numberOfVertices * 3 * sizeof(float);
+            sections[TerrainCache::DELTAS] = deltaValues;
+            header.sizes[TerrainCache::DELTAS] = numberOfVertices * sizeof(unsigned short);
+            sections[TerrainCache::PATCH_BOUNDS] = bounds;
+            header.sizes[TerrainCache::PATCH_BOUNDS] = numberOfPatches * 2 * sizeof(float);
+            sections[TerrainCache::PATCH_ERRORS] = errors;
+            header.sizes[TerrainCache::PATCH_ERRORS] = numberOfPatches * HeightMapPatch::MAX_LODS * sizeof(float);
+            sections[TerrainCache::PATCH_OCCLUDERS] = occluders;
+            header.sizes[TerrainCache::PATCH_OCCLUDERS] = numberOfPatches * occluderCells * sizeof(float);
+            sections[TerrainCache::PATCH_LODS] = lodTable;
+            header.sizes[TerrainCache::PATCH_LODS] = numberOfPatches * HeightMapPatch::INDEX_RANGES * 2 * sizeof(unsigned int);
+            sections[TerrainCache::INDICES] = indexBuffer->GetData();
+            header.sizes[TerrainCache::INDICES] = indexBuffer->GetSize() * sizeof(unsigned int);
+
+            TerrainCache::Write(cacheFile, header, sections);
+
+            delete [] bounds;
+            delete [] errors;
+            delete [] occluders;
+            delete [] lodTable;
+        }
+
         int HeightMapNode::CoordToIndex(const int x, const int z) const{
             return z + x * depth;
         }
@@ -745,12 +1711,12 @@ namespace OpenEngine {
             return (geomorphBuffer->GetData() + index * 3)[2];
         }
 
-        char& HeightMapNode::GetVerticeDelta(const int x, const int z) const{
+        unsigned short& HeightMapNode::GetVerticeDelta(const int x, const int z) const{
             int index = CoordToIndex(x, z);
             return GetVerticeDelta(index);
         }
 
-        char& HeightMapNode::GetVerticeDelta(const int index) const{
+        unsigned short& HeightMapNode::GetVerticeDelta(const int index) const{
             return deltaValues[index];
         }
 
@@ -12,10 +12,16 @@
 
 #include <Scene/ISceneNode.h>
 #include <Core/IListener.h>
+#include <Core/Event.h>
+#include <Core/Mutex.h>
 #include <Renderers/IRenderer.h>
 #include <Resources/Texture2D.h>
 #include <Display/Viewport.h>
 #include <Resources/DataBlock.h>
+#include <Scene/HeightMapLODState.h>
+
+#include <string>
+#include <vector>
 
 using namespace OpenEngine;
 using namespace OpenEngine::Core;
@@ -35,8 +41,26 @@ namespace OpenEngine {
     namespace Display {
         class IViewingVolume;
     }
+    namespace Utils {
+        class TerrainCache;
+        typedef boost::shared_ptr<TerrainCache> TerrainCachePtr;
+    }
     namespace Scene {
         class HeightMapPatch;
+        class HeightMapQuadTree;
+        class HeightMapNode;
+        class HeightMapLoader;
+
+        /**
+         * Fired on the rendering thread when a heightmap has been
+         * loaded and its buffers are ready for rendering.
+         */
+        struct HeightMapLoadedEventArg {
+            HeightMapNode* node;
+            Renderers::IRenderer& renderer;
+            HeightMapLoadedEventArg(HeightMapNode* node, Renderers::IRenderer& renderer)
+                : node(node), renderer(renderer) {}
+        };
 
         /**
          * A class for creating landscapes through heightmaps
@@ -58,10 +82,38 @@ namespace OpenEngine {
             public IListener<RenderingEventArg>, 
             public IListener<Core::ProcessEventArg> {
             OE_SCENE_NODE(HeightMapNode, ISceneNode)
+            friend class HeightMapLoader;
 
         public:
             static const int DIMENSIONS = 4;
             static const int TEXCOORDS = 2;
+            static const int HORIZON_AZIMUTHS = 8;
+
+            /**
+             * The phases of Load, timed in microseconds.
+             */
+            enum LoadPhase { IMPORT_PHASE = 0, VERTEX_PHASE, NORMAL_PHASE, 
+                             LOD_PHASE, GEOMORPH_PHASE, PATCH_PHASE, CACHE_PHASE,
+                             TOTAL_LOAD, LOAD_PHASES };
+
+            /**
+             * PATCH_LOD renders the fixed grid of patches with
+             * HeightMapPatch::MAX_LODS levels of detail and stitching
+             * between neighbours.
+             *
+             * QUADTREE_LOD renders the nodes of a HeightMapQuadTree,
+             * so far terrain is covered by a few large, coarse
+             * nodes. The geomorph buffer then holds {VertexX,
+             * VertexZ, LOD} and the shader should morph a vertex of
+             * level L = LOD - 1 by
+             *
+             *   start = range(L-1) + morphStart * (range(L) - range(L-1))
+             *   morph = clamp((distance - start) / (range(L) - start), 0, 1)
+             *
+             * with range(L) = baseDistance + (2^(L+1) - 1) / invIncDistance
+             * and range(-1) = 0.
+             */
+            enum LODMode { PATCH_LOD, QUADTREE_LOD };
 
         protected:
             Float4DataBlockPtr vertexBuffer;
@@ -72,10 +124,15 @@ namespace OpenEngine {
             FloatTexture2DPtr normalmap;
             Float3DataBlockPtr normalBuffer;
 
+            // Terrain self shadowing
+            bool horizonMapping;
+            int horizonDistance;
+            UCharTexture2DPtr horizonMaps[2];
+
             GeometrySetPtr geom;
             IndicesPtr indexBuffer;
 
-            char* deltaValues;
+            unsigned short* deltaValues;
 
             int width;
             int depth;
@@ -86,26 +143,125 @@ namespace OpenEngine {
             // Patch variables
             int patchGridWidth, patchGridDepth, numberOfPatches;
             HeightMapPatch** patchNodes;
+            LODMode lodMode;
+            HeightMapQuadTree* quadtree;
+            // The number of vertex LODs and the step of the coarsest.
+            int maxLOD, maxDelta;
 
             // Distances for changing the LOD
             float baseDistance;
             float invIncDistance;
+            // Screen space error tolerance in pixels, 0 to select
+            // the LOD from distances only.
+            float pixelError;
+            // Frame coherent LOD updates
+            bool incrementalLOD;
+            float lodHysteresis;
+            // Triangle and draw call budget
+            unsigned int triangleBudget, drawCallBudget;
+            float budgetSmoothing;
+            // Horizon occlusion culling
+            bool occlusionCulling;
+            unsigned int horizonBins;
+            // Bumped when the LOD settings or the heights change, so
+            // the LOD states know to update.
+            unsigned int lodVersion, heightVersion;
+            // The LOD state of the main view.
+            HeightMapLODState lodState;
 
             FloatTexture2DPtr tex;
+            // 8 or 16 bit source heightmaps, imported and released
+            // when loading.
+            UCharTexture2DPtr ucharSource;
+            Texture2DPtr(unsigned short) ushortSource;
             IShaderResourcePtr landscapeShader;
 
+            // Precomputed terrain data, see SetCacheFile. A loaded
+            // cache stays mapped while the buffers use it.
+            std::string cacheFile;
+            Utils::TerrainCachePtr cache;
+
             bool isLoaded;
+            unsigned int loadTimes[LOAD_PHASES];
+
+            // Background loading. The placeholder is a coarse grid of
+            // the source heights, drawn until the terrain is ready.
+            bool asyncLoad;
+            bool isReady; // buffers are setup for rendering
+            HeightMapLoader* loader;
+            Core::Mutex loadMutex;
+            bool loadFinished, placeholderReady;
+            int placeholderWidth, placeholderDepth;
+            float* placeholderVertices;
+            float* placeholderNormals;
+            Core::Event<HeightMapLoadedEventArg> loadedEvent;
 
         public:
             HeightMapNode() {}
             HeightMapNode(FloatTexture2DPtr tex);
+            /**
+             * Creates a heightmap from 8 or 16 bit height data. The
+             * heights are scaled directly into the padded heightmap
+             * when loading, after which the source is unloaded.
+             */
+            HeightMapNode(UCharTexture2DPtr tex);
+            HeightMapNode(Texture2DPtr(unsigned short) tex);
             ~HeightMapNode();
 
             void Load();
+            /**
+             * The wall clock time spent in a phase of the last Load
+             * in microseconds. Phases that were skipped, fx because
+             * the terrain was read from a cache, report 0.
+             */
+            unsigned int GetLoadTime(LoadPhase phase) const { return loadTimes[phase]; }
 
-            void CalcLOD(Display::IViewingVolume* view);
+            /**
+             * Load the heightmap on a worker thread instead of when
+             * the renderer is initialized. A placeholder grid is
+             * rendered until the data is ready, after which the
+             * buffers are created on the rendering thread and
+             * LoadedEvent is fired. Must be set before the renderer
+             * is initialized.
+             */
+            void SetAsyncLoad(const bool async) { asyncLoad = async; }
+            bool GetAsyncLoad() const { return asyncLoad; }
+            /**
+             * Finishes an asynchronous load if the worker is done.
+             * Must be called from the rendering thread.
+             *
+             * @return True if the heightmap is ready to be rendered.
+             */
+            bool UpdateLoad(Renderers::RenderingEventArg arg);
+            bool IsReady() const { return isReady; }
+            IEvent<HeightMapLoadedEventArg>& LoadedEvent() { return loadedEvent; }
+
+            /**
+             * Selects the LODs for the view. The viewport height in
+             * pixels is needed to project the patch errors when a
+             * screen space error is set.
+             */
+            void CalcLOD(Display::IViewingVolume* view, unsigned int viewportHeight = 0);
+            /**
+             * Selects the LODs for another view, fx a reflection or
+             * shadow view, into its own state. The heightmap isn't
+             * changed, so several views can be selected concurrently
+             * as long as the heightmap isn't edited meanwhile. The
+             * LOD budget only follows the main view.
+             */
+            void CalcLOD(Display::IViewingVolume* view, HeightMapLODState& state, 
+                         unsigned int viewportHeight = 0) const;
             void Render(Renderers::RenderingEventArg arg);
+            /**
+             * Renders the LODs selected into the state.
+             */
+            void Render(Renderers::RenderingEventArg arg, const HeightMapLODState& state);
             void RenderBoundingGeometry();
+            /**
+             * Renders the placeholder grid while loading
+             * asynchronously.
+             */
+            void RenderPlaceholder(Renderers::RenderingEventArg arg);
 
             void VisitSubNodes(ISceneNodeVisitor& visitor);
 
@@ -118,28 +274,32 @@ namespace OpenEngine {
              * Takes as argument a 3D vector in localspace and returns
              * the height of the heightmap at that point.
              *
-             * @return The height at the given point.
+             * @return The height at the given point, 0 while the
+             * heightmap is loading.
              */
             float GetHeight(Vector<3, float> point) const;
             /**
              * Takes as argument an x- and z-coord in localspace and
              * returns the height of the heightmap at that point.
              *
-             * @return The height at the given point.
+             * @return The height at the given point, 0 while the
+             * heightmap is loading.
              */
             float GetHeight(float x, float z) const;
             /**
              * Takes as argument a 3D vector in worldspace and returns
              * the normal of the heightmap at that point.
              *
-             * @return The normal at the given point.
+             * @return The normal at the given point, up while the
+             * heightmap is loading.
              */
             Vector<3, float> GetNormal(Vector<3, float> point) const;
             /**
              * Takes as argument an x- and z-coord in worldspace and
              * returns the normal of the heightmap at that point.
              *
-             * @return The normal at the given point.
+             * @return The normal at the given point, up while the
+             * heightmap is loading.
              */
             Vector<3, float> GetNormal(float x, float z) const;
             /**
@@ -164,11 +324,20 @@ namespace OpenEngine {
             inline IDataBlockPtr GetNormalMapCoordBuffer() const { return normalMapCoordBuffer; }
             inline IndicesPtr    GetIndices() const { return indexBuffer; }
             inline GeometrySetPtr GetGeometrySet() const { return geom; }
-            inline FloatTexture2DPtr GetHeightMap() const { return tex; }
-            inline ITexture2DPtr GetNormalMap() const { return normalmap; }
+            /**
+             * The height and normal maps, NULL while the heightmap is
+             * loading. The normal map is created with the buffers
+             * when the heightmap is ready.
+             */
+            inline FloatTexture2DPtr GetHeightMap() const { return HasTerrain() ? tex : FloatTexture2DPtr(); }
+            inline ITexture2DPtr GetNormalMap() const { return isReady ? normalmap : ITexture2DPtr(); }
 
             int GetIndice(int x, int z);
             float* GetVertex(int x, int z);
+            /**
+             * Changes the heights of the terrain. Ignored until the
+             * heightmap is ready.
+             */
             void SetVertex(int x, int z, float value);
             void SetVertices(int x, int z, int width, int depth, float* values);
             Vector<3, float> GetNormal(int x, int z);
@@ -188,9 +357,157 @@ namespace OpenEngine {
             float GetLODIncDistance() const { return 1.0f / invIncDistance; }
             float GetLODInverseIncDistance() const { return invIncDistance; }
 
+            /**
+             * Selects the patch LODs from their largest vertical
+             * error projected onto the screen instead of the
+             * distance. The coarsest LOD whose error is within the
+             * given number of pixels is used, so flat areas get few
+             * triangles. 0 disables it.
+             *
+             * The shader should then use the geomorphingScale
+             * uniform, set for each patch, instead of the distance to
+             * the patch center. Only used in PATCH_LOD mode.
+             */
+            void SetScreenSpaceError(const float pixels) { pixelError = pixels; }
+            float GetScreenSpaceError() const { return pixelError; }
+            /**
+             * Pixels per unit of error at distance 1 divided by the
+             * tolerance, as computed by the last CalcLOD. 0 when the
+             * screen space error isn't used.
+             */
+            float GetErrorScale() const { return lodState.GetErrorScale(); }
+
+            /**
+             * Only updates the distance based LOD of a patch once the
+             * view has moved far enough to change it. A patch only
+             * switches LOD once it is the hysteresis, in units of the
+             * incremental LOD distance, past the switch distance,
+             * so patches near a boundary don't flicker.
+             */
+            void SetIncrementalLOD(const bool incremental, const float hysteresis = 0.1f);
+            bool GetIncrementalLOD() const { return incrementalLOD; }
+            float GetLODHysteresis() const { return lodHysteresis; }
+            /**
+             * The number of patch LODs updated and skipped by the
+             * last CalcLOD.
+             */
+            unsigned int GetLODUpdates() const { return lodState.GetLODUpdates(); }
+            unsigned int GetLODSkips() const { return lodState.GetLODSkips(); }
+            float GetLODSkipRate() const { 
+                unsigned int total = GetLODUpdates() + GetLODSkips();
+                return total > 0 ? GetLODSkips() / float(total) : 0.0f;
+            }
+
+            /**
+             * Adjusts the LOD distances between frames to keep the
+             * triangles, and in QUADTREE_LOD mode the draw calls,
+             * near the budgets. Larger distances keep the finer LODs
+             * further out, so over budget the distances are divided
+             * by the square root of the load, since the triangles
+             * grow with the square of the distances, and under budget
+             * they are multiplied. The smoothing is the fraction of
+             * the correction applied each frame. With a screen space
+             * error the tolerance is multiplied by the root of the
+             * load instead. A budget of 0 disables it.
+             */
+            void SetLODBudget(const unsigned int triangles, const unsigned int drawCalls = 0, 
+                              const float smoothing = 0.2f);
+            unsigned int GetTriangleBudget() const { return triangleBudget; }
+            unsigned int GetDrawCallBudget() const { return drawCallBudget; }
+            /**
+             * The strip triangles and draw calls selected by the last
+             * CalcLOD.
+             */
+            unsigned int GetTriangleCount() const { return lodState.GetTriangleCount(); }
+            unsigned int GetDrawCallCount() const { return lodState.GetDrawCallCount(); }
+
+            /**
+             * Culls the patches hidden behind nearer terrain. The
+             * patches that pass the frustum test are visited front to
+             * back while a horizon of the given number of azimuth
+             * bins around the viewer is raised by the lowest heights
+             * of their occluder cells. A patch whose highest point is
+             * below the horizon in all the bins it covers is hidden.
+             * Only used in PATCH_LOD mode.
+             */
+            void SetOcclusionCulling(const bool cull, const unsigned int bins = 1024);
+            bool GetOcclusionCulling() const { return occlusionCulling; }
+            /**
+             * The number of patches culled by the horizon in the last
+             * CalcLOD.
+             */
+            unsigned int GetOccludedPatches() const { return lodState.GetOccludedPatches(); }
+            /**
+             * The visible patches near to far, as drawn by Render,
+             * selected by the last CalcLOD in PATCH_LOD mode.
+             */
+            const std::vector<int>& GetDrawOrder() const { return lodState.GetDrawOrder(); }
+            unsigned int GetDrawOrderSorts() const { return lodState.GetDrawOrderSorts(); }
+            /**
+             * The LOD state of the main view.
+             */
+            const HeightMapLODState& GetLODState() const { return lodState; }
+            /**
+             * Checks the horizon culling from the given position
+             * against rays traced through the heightmap to every
+             * step'th vertex of the patches it culls.
+             *
+             * @return False and logs the patch if a culled vertex
+             * can be seen.
+             */
+            bool CheckOcclusion(Vector<3, float> viewPos, const int step = 4) const;
+
+            /**
+             * Computes horizon maps for shadowing the terrain by
+             * itself. For every vertex and the HORIZON_AZIMUTHS
+             * directions a * 45 degrees from the x axis towards the z
+             * axis, the sine of the elevation of the highest terrain
+             * within distance vertices is stored in the RGBA channels
+             * of "horizonMap0" for a = 0-3 and "horizonMap1" for a =
+             * 4-7. The textures are sampled like the normal map, and a
+             * point is lit if the sun's elevation is above the
+             * horizon interpolated at the sun's azimuth.
+             *
+             * The maps are computed when the buffers are set up and
+             * updated where SetVertex and SetVertices change the
+             * horizon. Must be set before the heightmap is
+             * initialized.
+             */
+            void SetHorizonMapping(const bool horizon, const int distance = 64);
+            bool GetHorizonMapping() const { return horizonMapping; }
+            UCharTexture2DPtr GetHorizonMap(const int i) const { return horizonMaps[i]; }
+
+            /**
+             * Checks every combination of patch LOD and neighbour
+             * LODs for cracks, see HeightMapPatch::CheckStitching.
+             * Must be called after loading.
+             *
+             * @return True if the terrain is watertight.
+             */
+            bool CheckStitching() const;
+
+            /**
+             * Selects how the LOD is computed, must be set before
+             * the heightmap is loaded or starts loading in the
+             * background.
+             */
+            void SetLODMode(const LODMode mode);
+            LODMode GetLODMode() const { return lodMode; }
+            HeightMapQuadTree* GetQuadTree() const { return quadtree; }
+
             void SetLandscapeShader(IShaderResourcePtr shader) { landscapeShader = shader; }
             IShaderResourcePtr GetLandscapeShader() const { return landscapeShader; }
 
+            /**
+             * Sets a file to cache the precomputed terrain data in.
+             * If the file holds a cache of the same source and
+             * settings it is memory mapped and used when loading,
+             * otherwise it is written once the terrain has been
+             * computed.
+             */
+            void SetCacheFile(const std::string file) { cacheFile = file; }
+            std::string GetCacheFile() const { return cacheFile; }
+
         protected:
             // Virtual HeightMap framework methods
 
@@ -219,13 +536,42 @@ namespace OpenEngine {
              */
             virtual void PostRender(Renderers::RenderingEventArg arg) {}
 
+            /**
+             * True when the terrain data can be read, that is when
+             * the heightmap is ready or has been loaded on this
+             * thread. A background load may still be writing it, so
+             * isLoaded is only read when there is no loader.
+             */
+            bool HasTerrain() const { return isReady || (loader == NULL && isLoaded); }
+
+            void RenderPatches(const HeightMapLODState& state);
+
             // Setup methods
+            inline void Init();
+            inline void LoadSource();
+            inline void SetupPlaceholder();
+            inline void BackgroundLoad();
+            inline void SetupBuffers(RenderingEventArg arg);
             inline void InitArrays();
             inline void SetupNormalMap();
+            inline unsigned char ComputeHorizon(const int x, const int z, const int azimuth) const;
+            inline void UpdateHorizonMaps(const int xStart, const int zStart, const int xEnd, const int zEnd);
+            inline void SetupLODLevels();
             inline void CalcVerticeLOD();
             inline float CalcGeomorphHeight(int x, int z);
             inline void ComputeIndices();
             inline void SetupPatches();
+            inline void SetupQuadTree();
+            inline void UpdateNeighbourLODs(HeightMapLODState& state) const;
+            inline void UpdateLODBudget();
+            inline void UpdateDrawOrder(Vector<3, float> viewPos, HeightMapLODState& state) const;
+            inline void ComputeOcclusion(Vector<3, float> viewPos, const std::vector<int>& candidates,
+                                         const HeightMapLODState& state, std::vector<float>& horizon,
+                                         std::vector<int>& occluded) const;
+            inline bool IsVertexVisible(Vector<3, float> viewPos, int x, int z) const;
+            inline unsigned long long CacheHash() const;
+            inline bool LoadCache(unsigned long long hash);
+            inline void SaveCache(unsigned long long hash);
 
             /**
              * Returns the index into the arrays based on the coords.
@@ -248,8 +594,8 @@ namespace OpenEngine {
             inline float* GetGeomorphValues(const int x, const int z) const;
             inline float& GetVerticeLOD(const int x, const int z) const;
             inline float& GetVerticeLOD(const int index) const;
-            inline char& GetVerticeDelta(const int x, const int z) const;
-            inline char& GetVerticeDelta(const int index) const;
+            inline unsigned short& GetVerticeDelta(const int x, const int z) const;
+            inline unsigned short& GetVerticeDelta(const int index) const;
             inline int GetPatchIndex(const int x, const int z) const;
             inline HeightMapPatch* GetPatch(const int x, const int z) const;
         };
@@ -10,12 +10,13 @@
 #include <Scene/HeightMapPatch.h>
 #include <Scene/HeightMapNode.h>
 #include <Meta/OpenGL.h>
-#include <Display/IViewingVolume.h>
 #include <Logging/Logger.h>
 #include <math.h>
 #include <Resources/DataBlock.h>
 
 #include <cstring>
+#include <map>
+#include <set>
 
 using namespace OpenEngine::Display;
 using namespace OpenEngine::Resources;
@@ -24,8 +25,7 @@ namespace OpenEngine {
     namespace Scene {
         
         HeightMapPatch::HeightMapPatch(int xStart, int zStart, HeightMapNode* t)
-            : terrain(t), LOD(1), geomorphingScale(1), visible(false), 
-              xStart(xStart), zStart(zStart) {
+            : terrain(t), xStart(xStart), zStart(zStart) {
 
             xEnd = xStart + PATCH_EDGE_VERTICES;
             zEnd = zStart + PATCH_EDGE_VERTICES;
@@ -37,6 +37,43 @@ namespace OpenEngine {
             ComputeIndices();
             
             SetupBoundingBox();
+            ComputeErrors();
+            ComputeOccluders();
+        }
+
+        HeightMapPatch::HeightMapPatch(int xStart, int zStart, HeightMapNode* t,
+                                       float minHeight, float maxHeight, 
+                                       const float* errors, const float* occluders,
+                                       const unsigned int* lodTable, IndicesPtr indices)
+            : terrain(t), xStart(xStart), zStart(zStart), indexBuffer(indices) {
+
+            xEnd = xStart + PATCH_EDGE_VERTICES;
+            zEnd = zStart + PATCH_EDGE_VERTICES;
+            xEndMinusOne = xEnd - 1;
+            zEndMinusOne = zEnd - 1;
+
+            edgeLength = (xEndMinusOne - xStart) * t->GetWidthScale();
+
+            // The indices already live in the index buffer, so point
+            // into it instead of recomputing them.
+            LODstruct* lod = LODs;
+            for (int i = 0; i < INDEX_RANGES; ++i){
+                lod[i].numberOfIndices = lodTable[2 * i];
+                lod[i].indiceBufferOffset = lodTable[2 * i + 1];
+                lod[i].indices = lod[i].numberOfIndices > 0 ? indices->GetData() + lod[i].indiceBufferOffset : NULL;
+            }
+
+            min = Vector<3, float>(terrain->GetVertex(xStart, zStart));
+            max = Vector<3, float>(terrain->GetVertex(xEnd-1, zEnd-1));
+            min[1] = minHeight;
+            max[1] = maxHeight;
+            UpdateBoundingBox();
+            // Recomputing the errors and occluders would read every
+            // vertex.
+            for (int i = 0; i < MAX_LODS; ++i)
+                maxError[i] = errors[i];
+            for (int i = 0; i < OCCLUDER_CELLS * OCCLUDER_CELLS; ++i)
+                occluderHeight[i] = occluders[i];
         }
 
         HeightMapPatch::~HeightMapPatch(){
@@ -53,6 +90,8 @@ namespace OpenEngine {
             }
 
             UpdateBoundingBox();
+            ComputeErrors();
+            ComputeOccluders();
         }
 
         void HeightMapPatch::UpdateBoundingGeometry(float h){
@@ -93,66 +132,114 @@ namespace OpenEngine {
             }
 
             UpdateBoundingBox();
+            ComputeErrors();
+            ComputeOccluders();
         }
         
-        void HeightMapPatch::CalcLOD(IViewingVolume* view){
-            visible = view->IsVisible(boundingBox);
-            if (!visible) return;
+        bool HeightMapPatch::CalcLOD(bool visible, Vector<3, float> viewPos, float errorScale, 
+                                     float baseDistance, float invIncDistance, PatchLODState& state) const{
+            state.visible = visible;
+
+            // The neighbours need the LOD of hidden patches as well
+            // when it depends on their errors or history.
+            if (errorScale > 0){
+                CalcErrorLOD(viewPos, errorScale, state);
+                return true;
+            }
 
-            Vector<3, float> viewPos = view->GetPosition();
-            float baseDistance = terrain->GetLODBaseDistance();
-            float invIncDistance = terrain->GetLODInverseIncDistance();
+            if (terrain->GetIncrementalLOD()){
+                // The distance to the patch changes by at most the
+                // distance the view has moved.
+                if ((viewPos - state.lodViewPos).GetLengthSquared() < state.lodSlack)
+                    return false;
+                CalcIncrementalLOD(viewPos, baseDistance, invIncDistance, state);
+                return true;
+            }
+
+            if (!state.visible) return true;
 
             // Calculate own LOD
             float distance = (viewPos - patchCenter).GetLength();
             distance -= baseDistance;
 
-            geomorphingScale = distance * invIncDistance;
+            float geomorphingScale = distance * invIncDistance;
 
             if (geomorphingScale < 1)
                 geomorphingScale = 1;
             else if (geomorphingScale > MAX_LODS)
                 geomorphingScale = MAX_LODS;
 
-            LOD = floor(geomorphingScale) - 1;
+            state.geomorphingScale = geomorphingScale;
+            state.LOD = floor(geomorphingScale) - 1;
 
             // Calculate upper LOD
             distance = (viewPos - (patchCenter + Vector<3, float>(edgeLength, 0, 0))).GetLength();
             distance -= baseDistance;
 
-            upperGeomorphingScale = distance * invIncDistance;
+            float upperGeomorphingScale = distance * invIncDistance;
             if (upperGeomorphingScale < 1)
                 upperGeomorphingScale = 1;
             else if (upperGeomorphingScale > MAX_LODS)
                 upperGeomorphingScale = MAX_LODS;
 
-            upperLOD = floor(upperGeomorphingScale) - 1;
+            state.upperLOD = floor(upperGeomorphingScale) - 1;
 
             // Calculate right LOD
             distance = (viewPos - (patchCenter + Vector<3, float>(0, 0, edgeLength))).GetLength();
             distance -= baseDistance;
 
-            rightGeomorphingScale = distance * invIncDistance;
+            float rightGeomorphingScale = distance * invIncDistance;
             if (rightGeomorphingScale < 1)
                 rightGeomorphingScale = 1;
             else if (rightGeomorphingScale > MAX_LODS)
                 rightGeomorphingScale = MAX_LODS;
 
-            rightLOD = floor(rightGeomorphingScale) - 1;
+            state.rightLOD = floor(rightGeomorphingScale) - 1;
+            return true;
+        }
+
+        void HeightMapPatch::Render(const PatchLODState& state) const{
+            if (state.visible){
+                // Draw the body and the two stitchings as separate
+                // strips.
+                const LODstruct* ranges[3] = { &LODs[BodyRange(state.LOD)], 
+                                               &LODs[RightRange(state.LOD, state.rightLOD)], 
+                                               &LODs[UpperRange(state.LOD, state.upperLOD)] };
+                GLsizei counts[3];
+                const GLvoid* offsets[3];
+                bool buffered = indexBuffer->GetID() != 0;
+                for (int i = 0; i < 3; ++i){
+                    counts[i] = ranges[i]->numberOfIndices;
+                    if (buffered)
+                        offsets[i] = (GLvoid*)(ranges[i]->indiceBufferOffset * sizeof(GLuint));
+                    else
+                        offsets[i] = indexBuffer->GetData() + ranges[i]->indiceBufferOffset;
+                }
+                glMultiDrawElements(GL_TRIANGLE_STRIP, counts, GL_UNSIGNED_INT, offsets, 3);
+            }
+        }
+
+        unsigned int HeightMapPatch::GetNumberOfTriangles(const PatchLODState& state) const{
+            if (!state.visible) return 0;
+            const LODstruct* ranges[3] = { &LODs[BodyRange(state.LOD)], 
+                                           &LODs[RightRange(state.LOD, state.rightLOD)], 
+                                           &LODs[UpperRange(state.LOD, state.upperLOD)] };
+            unsigned int triangles = 0;
+            for (int i = 0; i < 3; ++i)
+                if (ranges[i]->numberOfIndices > 2)
+                    triangles += ranges[i]->numberOfIndices - 2;
+            return triangles;
         }
 
-        void HeightMapPatch::Render() const{
-            if (visible){
-                int rightLODdiff = rightLOD - LOD + 1;
-                int upperLODdiff = upperLOD - LOD + 1;
-
-                unsigned int numberOfIndices = LODs[LOD][rightLODdiff][upperLODdiff].numberOfIndices;
-                unsigned int offset = LODs[LOD][rightLODdiff][upperLODdiff].indiceBufferOffset;
-                if (indexBuffer->GetID() != 0)
-                    glDrawElements(GL_TRIANGLE_STRIP, numberOfIndices, GL_UNSIGNED_INT, (void*)(offset * sizeof(GLuint)));
-                else
-                    glDrawElements(GL_TRIANGLE_STRIP, numberOfIndices, GL_UNSIGNED_INT, indexBuffer->GetData() + offset);
+        float HeightMapPatch::GetDistanceSquared(const Vector<3, float>& point) const{
+            float distance = 0.0f;
+            for (int i = 0; i < 3; ++i){
+                float d = 0.0f;
+                if (point[i] < min[i]) d = min[i] - point[i];
+                else if (point[i] > max[i]) d = point[i] - max[i];
+                distance += d * d;
             }
+            return distance;
         }
 
         void HeightMapPatch::RenderBoundingGeometry() const{
@@ -171,56 +258,90 @@ namespace OpenEngine {
             glEnd();
         }
 
+        bool HeightMapPatch::CheckStitching(const int lod, const int rightlod, const int upperlod) const{
+            std::vector<unsigned int> triangles;
+            AddStripTriangles(LODs[BodyRange(lod)], triangles);
+            AddStripTriangles(LODs[RightRange(lod, rightlod)], triangles);
+            AddStripTriangles(LODs[UpperRange(lod, upperlod)], triangles);
+
+            int depth = terrain->GetVerticeDepth();
+            int xLast = xEndMinusOne, zLast = zEndMinusOne;
+
+            // Every triangle must have the winding of the first and
+            // the areas must add up to the patch.
+            std::map<std::pair<unsigned int, unsigned int>, int> edges;
+            long long area = 0;
+            for (unsigned int t = 0; t < triangles.size(); t += 3){
+                unsigned int v[3] = { triangles[t], triangles[t+1], triangles[t+2] };
+                long long ax = v[0] / depth, az = v[0] % depth;
+                long long bx = v[1] / depth, bz = v[1] % depth;
+                long long cx = v[2] / depth, cz = v[2] % depth;
+                long long cross = (bx - ax) * (cz - az) - (bz - az) * (cx - ax);
+                if (cross >= 0){
+                    logger.warning << "Patch LOD " << lod << "/" << rightlod << "/" << upperlod 
+                                   << " has a triangle with the wrong winding" << logger.end;
+                    return false;
+                }
+                area -= cross;
+                for (int i = 0; i < 3; ++i)
+                    ++edges[std::make_pair(v[i], v[(i+1) % 3])];
+            }
+            if (area != 2LL * PATCH_EDGE_SQUARES * PATCH_EDGE_SQUARES){
+                logger.warning << "Patch LOD " << lod << "/" << rightlod << "/" << upperlod 
+                               << " covers " << area / 2.0 << " squares" << logger.end;
+                return false;
+            }
+
+            // Edges without a twin are on the border of the patch, and
+            // must follow the vertices used on each side: the left
+            // and lower neighbours stitch to this LOD, the right and
+            // upper are stitched to.
+            std::set<std::pair<unsigned int, unsigned int> > border;
+            int delta = 1 << lod, rightDelta = 1 << rightlod, upperDelta = 1 << upperlod;
+            for (int z = zStart; z < zLast; z += delta)
+                border.insert(std::make_pair(terrain->GetIndice(xStart, z), terrain->GetIndice(xStart, z + delta)));
+            for (int x = xStart; x < xLast; x += delta)
+                border.insert(std::make_pair(terrain->GetIndice(x, zStart), terrain->GetIndice(x + delta, zStart)));
+            for (int x = xStart; x < xLast; x += rightDelta)
+                border.insert(std::make_pair(terrain->GetIndice(x, zLast), terrain->GetIndice(x + rightDelta, zLast)));
+            for (int z = zStart; z < zLast; z += upperDelta)
+                border.insert(std::make_pair(terrain->GetIndice(xLast, z), terrain->GetIndice(xLast, z + upperDelta)));
+
+            unsigned int borderEdges = 0;
+            std::map<std::pair<unsigned int, unsigned int>, int>::iterator itr;
+            for (itr = edges.begin(); itr != edges.end(); ++itr){
+                unsigned int a = itr->first.first, b = itr->first.second;
+                bool twin = edges.find(std::make_pair(b, a)) != edges.end();
+                bool onBorder = border.count(std::make_pair(a, b)) || border.count(std::make_pair(b, a));
+                if (itr->second != 1 || twin == onBorder){
+                    logger.warning << "Patch LOD " << lod << "/" << rightlod << "/" << upperlod 
+                                   << " has a crack or overlap at (" << a / depth << ", " << a % depth 
+                                   << ") - (" << b / depth << ", " << b % depth << ")" << logger.end;
+                    return false;
+                }
+                if (onBorder) ++borderEdges;
+            }
+            if (borderEdges != border.size()){
+                logger.warning << "Patch LOD " << lod << "/" << rightlod << "/" << upperlod 
+                               << " doesn't follow the vertices of its neighbours" << logger.end;
+                return false;
+            }
+
+            return true;
+        }
+
         // **** inlined functions ****
 
         void HeightMapPatch::ComputeIndices(){
-
             for (int i = 0; i < MAX_LODS; ++i){
-                int bodyIndices;
-                unsigned int* body = ComputeBodyIndices(bodyIndices, i);
-                
-                for (int j = 0; j < 3; ++j){
-                    int rightIndices;
-                    unsigned int* right = ComputeRightStichingIndices(rightIndices, i, (LODrelation) j);
-
-                    for (int k = 0; k < 3; ++k){
-                        int upperIndices;
-                        unsigned int* upper = ComputeUpperStichingIndices(upperIndices, i, (LODrelation) k);
-
-                        if (rightIndices > 0 && upperIndices > 0){
-                            LODs[i][j][k].numberOfIndices = bodyIndices + rightIndices + upperIndices + 4;
-                            LODs[i][j][k].indices = new unsigned int[LODs[i][j][k].numberOfIndices];
-                            
-                            int c = 0; // a counter into the array of indices
-                            // Copy the body of the lod
-                            memcpy(LODs[i][j][k].indices, body, bodyIndices * sizeof(unsigned int));
-                            c += bodyIndices;
-                            
-                            // Add indices to draw 2 degenerate triangles
-                            LODs[i][j][k].indices[c++] = body[bodyIndices-1];
-                            LODs[i][j][k].indices[c++] = right[0];
-                            
-                            // Copy the right stitching
-                            memcpy(LODs[i][j][k].indices + c, right, rightIndices * sizeof(unsigned int));
-                            c += rightIndices;
-                            
-                            // Add indices to draw 2 degenerate triangles
-                            LODs[i][j][k].indices[c++] = right[rightIndices-1];
-                            LODs[i][j][k].indices[c++] = upper[0];
-                            
-                            // Copy the upper stitching
-                            memcpy(LODs[i][j][k].indices + c, upper, upperIndices * sizeof(unsigned int));
-                        }else{
-                            LODs[i][j][k].numberOfIndices = 0;
-                            LODs[i][j][k].indices = NULL;
-                        }
-                        delete[] upper;
-                    }
-
-                    delete[] right;
+                LODstruct& body = LODs[BodyRange(i)];
+                body.indices = ComputeBodyIndices(body.numberOfIndices, i);
+                for (int j = 0; j < MAX_LODS; ++j){
+                    LODstruct& right = LODs[RightRange(i, j)];
+                    right.indices = ComputeStitchingIndices(right.numberOfIndices, i, j, false);
+                    LODstruct& upper = LODs[UpperRange(i, j)];
+                    upper.indices = ComputeStitchingIndices(upper.numberOfIndices, i, j, true);
                 }
-
-                delete[] body;
             }
         }
         
@@ -248,123 +369,87 @@ namespace OpenEngine {
             return ret;
         }
 
-        unsigned int* HeightMapPatch::ComputeRightStichingIndices(int& indices, int LOD, LODrelation rightLOD){
-            int delta = pow(2, LOD);
-
-            int i = 0;
-
-            switch (rightLOD){
-            case LOWER:
-                {
-                    if (delta > 1){
-                        int rightDelta = delta / 2;
-                        
-                        indices = 4 * PATCH_EDGE_SQUARES / delta + 1;
-                        unsigned int* ret = new unsigned int[indices];
-                        
-                        for (int x = xEndMinusOne - delta; x >= xStart; x -= delta){
-                            ret[i++] = terrain->GetIndice(x + delta, zEndMinusOne);
-                            ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                            ret[i++] = terrain->GetIndice(x + rightDelta, zEndMinusOne);
-                            ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                        }
-                        ret[i++] = terrain->GetIndice(xStart, zEndMinusOne);
-
-                        return ret;
-                    }else{
-                        indices = 0;
-                        return NULL;
-                    }
-                }
-            case SAME:
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
-
-                    ret[i++] = terrain->GetIndice(xEndMinusOne, zEndMinusOne);
-                    for (int x = xEndMinusOne - delta; x >= xStart; x -= delta){
-                        ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                        ret[i++] = terrain->GetIndice(x, zEndMinusOne);
-                    }
-
-                    return ret;
-                }
-            default: // HIGHER
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
-                    
-                    for (int x = xEndMinusOne - 2 * delta; x >= xStart; x -= 2 * delta){
-                        ret[i++] = terrain->GetIndice(x + 2 * delta, zEndMinusOne);
-                        ret[i++] = terrain->GetIndice(x + delta, zEndMinusOne - delta);
-                        ret[i++] = terrain->GetIndice(x + 2 * delta, zEndMinusOne);
-                        ret[i++] = terrain->GetIndice(x, zEndMinusOne - delta);
-                    }
-                    ret[i++] = terrain->GetIndice(xStart, zEnd - 1);
+        unsigned int HeightMapPatch::GetStitchIndice(bool upper, int along, int across) const{
+            return upper ? terrain->GetIndice(across, along) : terrain->GetIndice(along, across);
+        }
 
-                    return ret;
+        unsigned int* HeightMapPatch::ComputeStitchingIndices(int& indices, int LOD, int neighbourLOD, bool upper){
+            // The stitching fills the last row of squares along the
+            // edge, between the inner row of the body and the edge
+            // vertices used by the neighbour. The right stitching
+            // runs along x at the z edge, the upper along z at the x
+            // edge.
+            int delta = 1 << LOD;
+            int neighbourDelta = 1 << neighbourLOD;
+            int start = upper ? zStart : xStart;
+            int end = start + PATCH_EDGE_SQUARES;
+            int edge = upper ? xEndMinusOne : zEndMinusOne;
+            int inner = edge - delta;
+
+            // Zip the two rows together from the start. The inner row
+            // ends a square before the corner, the remaining edge
+            // vertices are fanned from its last vertex.
+            std::vector<unsigned int> strip;
+            int i = start, e = start;
+            strip.push_back(GetStitchIndice(upper, i, inner));
+            strip.push_back(GetStitchIndice(upper, e, edge));
+            bool lastInner = false;
+            while (i < end - delta || e < end){
+                bool advanceInner = e == end || 
+                    (i < end - delta && i + delta <= e + neighbourDelta);
+                // Advancing the same row twice in a row needs a
+                // degenerate triangle to keep the strip going.
+                if (advanceInner == lastInner)
+                    strip.push_back(advanceInner ? GetStitchIndice(upper, e, edge) : GetStitchIndice(upper, i, inner));
+                if (advanceInner){
+                    i += delta;
+                    strip.push_back(GetStitchIndice(upper, i, inner));
+                }else{
+                    e += neighbourDelta;
+                    strip.push_back(GetStitchIndice(upper, e, edge));
                 }
+                lastInner = advanceInner;
             }
-        }
-
-        unsigned int* HeightMapPatch::ComputeUpperStichingIndices(int& indices, int LOD, LODrelation upperLOD){
-            int delta = pow(2, LOD);
 
-            int i = 0;
-
-            switch (upperLOD){
-            case LOWER:
-                {
-                    if (delta > 1){
-                        int upperDelta = delta / 2;
-                        
-                        indices = 4 * PATCH_EDGE_SQUARES / delta + 1;
-                        unsigned int* ret = new unsigned int[indices];
-                        
-                        for (int z = zEndMinusOne - delta; z >= zStart; z -= delta){
-                            ret[i++] = terrain->GetIndice(xEndMinusOne, z + delta);
-                            ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                            ret[i++] = terrain->GetIndice(xEndMinusOne, z + upperDelta);
-                            ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                        }
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, zStart);
-                        
-                        return ret;
-                    }else{
-                        indices = 0;
-                        return NULL;
-                    }
-
-                }
-            case SAME:
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
+            // Match the winding of the body by shifting the strip
+            // parity if needed.
+            if (StripWinding(&strip[0], strip.size()) != StripWinding(LODs[BodyRange(LOD)].indices, LODs[BodyRange(LOD)].numberOfIndices))
+                strip.insert(strip.begin(), strip.front());
 
+            indices = strip.size();
+            unsigned int* ret = new unsigned int[indices];
+            memcpy(ret, &strip[0], sizeof(unsigned int) * indices);
+            return ret;
+        }
 
-                    ret[i++] = terrain->GetIndice(xEndMinusOne, zEndMinusOne);
-                    for (int z = zEndMinusOne - delta; z >= zStart; z -= delta){
-                        ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, z);
-                    }
-                    return ret;
-                }
-            default: // HIGHER
-                {
-                    indices = 2 * PATCH_EDGE_SQUARES / delta + 1;
-                    unsigned int* ret = new unsigned int[indices];
-                    
-                    for (int z = zEndMinusOne - 2 * delta; z >= zStart; z -= 2 * delta){
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, z + 2 * delta);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z + delta);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne, z + 2 * delta);
-                        ret[i++] = terrain->GetIndice(xEndMinusOne - delta, z);
-                    }
-                    ret[i++] = terrain->GetIndice(xEnd - 1, zStart);
+        void HeightMapPatch::AddStripTriangles(const LODstruct& range, std::vector<unsigned int>& triangles) const{
+            // Unpack the proper triangles of the strip with the
+            // winding they are drawn with.
+            for (int t = 0; t + 2 < range.numberOfIndices; ++t){
+                unsigned int a = range.indices[t], b = range.indices[t+1], c = range.indices[t+2];
+                if (a == b || b == c || a == c) continue;
+                if (t % 2) std::swap(a, b);
+                triangles.push_back(a);
+                triangles.push_back(b);
+                triangles.push_back(c);
+            }
+        }
 
-                    return ret;
-                }
+        int HeightMapPatch::StripWinding(const unsigned int* strip, int indices) const{
+            // The winding of the first proper triangle, where odd
+            // triangles of a strip are flipped.
+            int depth = terrain->GetVerticeDepth();
+            for (int t = 0; t + 2 < indices; ++t){
+                unsigned int a = strip[t], b = strip[t+1], c = strip[t+2];
+                if (a == b || b == c || a == c) continue;
+                long long ax = a / depth, az = a % depth;
+                long long bx = b / depth, bz = b % depth;
+                long long cx = c / depth, cz = c % depth;
+                long long cross = (bx - ax) * (cz - az) - (bz - az) * (cx - ax);
+                if (cross == 0) continue;
+                return (cross > 0) == (t % 2 == 0) ? 1 : -1;
             }
+            return 0;
         }
 
         void HeightMapPatch::SetupBoundingBox(){
@@ -382,6 +467,112 @@ namespace OpenEngine {
             UpdateBoundingBox();
         }
 
+        void HeightMapPatch::ComputeErrors(){
+            // The vertices removed by LOD l are interpolated between
+            // their neighbours on the coarser grid, like the
+            // geomorphing. Summing the largest interpolation error of
+            // each removed level bounds the error of the LOD.
+            maxError[0] = 0.0f;
+            for (int l = 1; l < MAX_LODS; ++l){
+                int delta = 1 << (l - 1);
+                float error = 0.0f;
+                for (int x = xStart; x < xEnd; x += delta){
+                    for (int z = zStart; z < zEnd; z += delta){
+                        int dx = (x - xStart) % (delta * 2);
+                        int dz = (z - zStart) % (delta * 2);
+                        if (dx == 0 && dz == 0) continue;
+
+                        float height = terrain->GetVertex(x, z)[1];
+                        float neighbour1 = terrain->GetVertex(x + dx, z + dz)[1];
+                        float neighbour2 = terrain->GetVertex(x - dx, z - dz)[1];
+                        float e = fabs((neighbour1 + neighbour2) / 2 - height);
+                        error = e > error ? e : error;
+                    }
+                }
+                maxError[l] = maxError[l-1] + error;
+            }
+        }
+
+        void HeightMapPatch::ComputeOccluders(){
+            for (int i = 0; i < OCCLUDER_CELLS; ++i)
+                for (int j = 0; j < OCCLUDER_CELLS; ++j){
+                    int x0 = xStart + i * OCCLUDER_CELL_SQUARES;
+                    int z0 = zStart + j * OCCLUDER_CELL_SQUARES;
+                    float lowest = terrain->GetVertex(x0, z0)[1];
+                    for (int x = x0; x <= x0 + OCCLUDER_CELL_SQUARES; ++x)
+                        for (int z = z0; z <= z0 + OCCLUDER_CELL_SQUARES; ++z){
+                            float y = terrain->GetVertex(x, z)[1];
+                            lowest = y < lowest ? y : lowest;
+                        }
+                    occluderHeight[j + i * OCCLUDER_CELLS] = lowest;
+                }
+        }
+
+        void HeightMapPatch::CalcErrorLOD(Vector<3, float> viewPos, float errorScale, PatchLODState& state) const{
+            // Distance to the bounding box.
+            float distance = 0.0f;
+            for (int i = 0; i < 3; ++i){
+                float d = 0.0f;
+                if (viewPos[i] < min[i]) d = min[i] - viewPos[i];
+                else if (viewPos[i] > max[i]) d = viewPos[i] - max[i];
+                distance += d * d;
+            }
+            distance = sqrt(distance);
+
+            // LOD l is acceptable beyond the distance where its error
+            // projects to the tolerance, errorScale being pixels per
+            // unit of error at distance 1 divided by the tolerance.
+            unsigned int LOD = 0;
+            while (LOD + 1 < (unsigned int)MAX_LODS && 
+                   maxError[LOD + 1] * errorScale <= distance)
+                ++LOD;
+
+            // Morph towards the next LOD between the distances
+            // where the two LODs become acceptable.
+            float morph = 0.0f;
+            if (LOD + 1 < (unsigned int)MAX_LODS){
+                float lodStart = maxError[LOD] * errorScale;
+                float lodEnd = maxError[LOD + 1] * errorScale;
+                if (lodEnd > lodStart)
+                    morph = (distance - lodStart) / (lodEnd - lodStart);
+                morph = morph < 0.0f ? 0.0f : (morph > 0.999f ? 0.999f : morph);
+            }
+            state.geomorphingScale = LOD + 1 + morph;
+            state.LOD = state.rightLOD = state.upperLOD = LOD;
+        }
+
+        void HeightMapPatch::CalcIncrementalLOD(Vector<3, float> viewPos, float baseDistance, float invIncDistance, 
+                                                PatchLODState& state) const{
+            float hysteresis = terrain->GetLODHysteresis();
+
+            float distance = (viewPos - patchCenter).GetLength() - baseDistance;
+            float scale = distance * invIncDistance;
+
+            state.geomorphingScale = scale < 1 ? 1 : (scale > MAX_LODS ? MAX_LODS : scale);
+            int target = floor(state.geomorphingScale) - 1;
+
+            // Only switch once the scale is past the band boundary by
+            // the hysteresis margin.
+            int lod = state.LOD;
+            if (target > lod && scale < lod + 2 + hysteresis) target = lod;
+            if (target < lod && scale > lod + 1 - hysteresis) target = lod;
+            unsigned int LOD = target;
+
+            // The distance to the nearest switch.
+            float slack = -1.0f;
+            if (LOD + 1 < (unsigned int)MAX_LODS)
+                slack = LOD + 2 + hysteresis - scale;
+            if (LOD > 0){
+                float down = scale - (LOD + 1 - hysteresis);
+                slack = slack < 0.0f || down < slack ? down : slack;
+            }
+            slack /= invIncDistance;
+            state.lodSlack = slack > 0.0f ? slack * slack : 0.0f;
+            state.lodViewPos = viewPos;
+
+            state.LOD = state.rightLOD = state.upperLOD = LOD;
+        }
+
         void HeightMapPatch::UpdateBoundingBox(){
             patchCenter = (min + max) / 2;
             boundingBox = Box(patchCenter, max - patchCenter);
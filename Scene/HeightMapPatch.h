@@ -12,6 +12,8 @@
 
 #include <Geometry/Box.h>
 
+#include <vector>
+
 using namespace OpenEngine::Geometry;
 
 namespace OpenEngine {
@@ -19,9 +21,6 @@ namespace OpenEngine {
         class Indices;
         typedef boost::shared_ptr<Indices > IndicesPtr;
     }
-    namespace Display{
-        class IViewingVolume;
-    }
     namespace Scene {
         class HeightMapNode;
 
@@ -30,24 +29,46 @@ namespace OpenEngine {
             unsigned int* indices;
             unsigned int indiceBufferOffset;
         };
+
+        /**
+         * The LOD of a patch for a view, see HeightMapLODState.
+         */
+        struct PatchLODState {
+            unsigned int LOD, upperLOD, rightLOD;
+            float geomorphingScale;
+            bool visible;
+            // The view position at the last LOD update and the
+            // squared distance it can move before the LOD can change.
+            Vector<3, float> lodViewPos;
+            float lodSlack;
+            PatchLODState() : LOD(1), upperLOD(1), rightLOD(1), geomorphingScale(1), 
+                              visible(false), lodSlack(0.0f) {}
+        };
         
         class HeightMapPatch {
 
         public:
             static const int PATCH_EDGE_SQUARES = 32;
             static const int PATCH_EDGE_VERTICES = PATCH_EDGE_SQUARES + 1;
-            static const int MAX_LODS = 3;
-            static const int MAX_DELTA = 4; //pow(2, MAX_LODS-1);
-
-            enum LODrelation { LOWER = 0, SAME = 1, HIGHER = 2 };
+            static const int MAX_LODS = 5;
+            static const int MAX_DELTA = 16; //pow(2, MAX_LODS-1);
+            /**
+             * The index ranges of a patch: a body for each LOD and a
+             * right and upper stitching for each pair of LOD and
+             * neighbour LOD, so neighbours can differ by any number
+             * of LODs.
+             */
+            static const int INDEX_RANGES = MAX_LODS + 2 * MAX_LODS * MAX_LODS;
+            /**
+             * The patch is split into OCCLUDER_CELLS^2 cells, whose
+             * lowest heights occlude the terrain behind them.
+             */
+            static const int OCCLUDER_CELLS = 4;
+            static const int OCCLUDER_CELL_SQUARES = PATCH_EDGE_SQUARES / OCCLUDER_CELLS;
             
         private:
             HeightMapNode* terrain;
 
-            unsigned int LOD, upperLOD, rightLOD;
-            float geomorphingScale, rightGeomorphingScale, upperGeomorphingScale;
-            bool visible;
-            
             int xStart, zStart, xEnd, zEnd, xEndMinusOne, zEndMinusOne;
             Vector<3, float> patchCenter;
             Geometry::Box boundingBox;
@@ -55,35 +76,115 @@ namespace OpenEngine {
             float edgeLength;
 
             Resources::IndicesPtr indexBuffer;
-            LODstruct LODs[MAX_LODS][3][3];
-            
+            LODstruct LODs[INDEX_RANGES];
+            // The largest vertical error of each LOD.
+            float maxError[MAX_LODS];
+            // The lowest height of each occluder cell, z + x * OCCLUDER_CELLS.
+            float occluderHeight[OCCLUDER_CELLS * OCCLUDER_CELLS];
+
         public:            
             HeightMapPatch() {}
             HeightMapPatch(int xStart, int zStart, HeightMapNode* t);
+            /**
+             * Creates a patch from precomputed data, fx from a
+             * terrain cache.
+             *
+             * @param errors The MAX_LODS errors of GetMaxError.
+             * @param occluders The occluder cell heights of
+             * GetOccluderHeight, z + x * OCCLUDER_CELLS.
+             * @param lodTable INDEX_RANGES pairs of {number of
+             * indices, offset into the index buffer} in LODs order.
+             */
+            HeightMapPatch(int xStart, int zStart, HeightMapNode* t,
+                           float minHeight, float maxHeight, 
+                           const float* errors, const float* occluders,
+                           const unsigned int* lodTable, Resources::IndicesPtr indices);
             ~HeightMapPatch();
 
             void UpdateBoundingGeometry();
             void UpdateBoundingGeometry(float height);
 
             // Render functions
-            void CalcLOD(Display::IViewingVolume* view);
-            void Render() const;
+            /**
+             * Selects the LOD from the distance to the patch, or from
+             * the projected error if errorScale is positive. In the
+             * latter case, and when the terrain uses incremental LOD
+             * updates, the LODs of the neighbours are set by the
+             * terrain afterwards.
+             *
+             * The neighbours may be any number of LODs apart. Only
+             * the state is written, so different views can be
+             * computed concurrently.
+             *
+             * @param visible If the view sees the patch.
+             * @param baseDistance The LOD distances of the view.
+             *
+             * @return False if the LOD update was skipped because the
+             * view hasn't moved enough to change it.
+             */
+            bool CalcLOD(bool visible, Vector<3, float> viewPos, float errorScale, 
+                         float baseDistance, float invIncDistance, PatchLODState& state) const;
+            void Render(const PatchLODState& state) const;
             void RenderBoundingGeometry() const;
 
             // *** Get/Set methods ***
 
             void SetDataIndices(IndicesPtr i) { indexBuffer = i; }
-            int GetLOD() const { return LOD; }
-            inline bool IsVisible() const { return visible; }
-            float GetGeomorphingScale() const { return geomorphingScale; }
-            LODstruct& GetLodStruct(const int lod, const int rightlod, const int upperlod) { return (LODs[lod][rightlod][upperlod]); }
+            float GetMaxError(const int lod) const { return maxError[lod]; }
+            /**
+             * The lowest height of an occluder cell.
+             */
+            float GetOccluderHeight(const int x, const int z) const { return occluderHeight[z + x * OCCLUDER_CELLS]; }
+            /**
+             * How far the rendered surface may be from the vertex
+             * heights at a LOD, including the morph towards the next
+             * one.
+             */
+            float GetLODError(const unsigned int lod) const { return maxError[lod + 1 < MAX_LODS ? lod + 1 : lod]; }
+            int GetXStart() const { return xStart; }
+            int GetZStart() const { return zStart; }
+            /**
+             * The number of strip triangles, including degenerate
+             * ones, drawn by Render.
+             */
+            unsigned int GetNumberOfTriangles(const PatchLODState& state) const;
+            LODstruct& GetLodStruct(const int range) { return LODs[range]; }
+            static int BodyRange(const int lod) { return lod; }
+            static int RightRange(const int lod, const int rightlod) { return MAX_LODS + lod * MAX_LODS + rightlod; }
+            static int UpperRange(const int lod, const int upperlod) { return MAX_LODS * (1 + MAX_LODS) + lod * MAX_LODS + upperlod; }
             Vector<3, float> GetCenter() const { return patchCenter; }
+            /**
+             * The squared distance from a point to the bounding box.
+             */
+            float GetDistanceSquared(const Vector<3, float>& point) const;
+            Vector<3, float> GetMin() const { return min; }
+            Vector<3, float> GetMax() const { return max; }
+            float GetMinHeight() const { return min[1]; }
+            float GetMaxHeight() const { return max[1]; }
+
+            /**
+             * Checks that the triangles of a LOD combination cover
+             * the patch exactly once with the same winding, and that
+             * its edges use the vertices of the neighbours, so the
+             * terrain is watertight.
+             *
+             * @return False and logs the problem if not.
+             */
+            bool CheckStitching(const int lod, const int rightlod, const int upperlod) const;
 
         protected:
             inline void ComputeIndices();
             inline unsigned int* ComputeBodyIndices(int& indices, int LOD);
-            inline unsigned int* ComputeRightStichingIndices(int& indices, int LOD, LODrelation rightLOD);
-            inline unsigned int* ComputeUpperStichingIndices(int& indices, int LOD, LODrelation upperLOD);
+            inline unsigned int* ComputeStitchingIndices(int& indices, int LOD, int neighbourLOD, bool upper);
+            inline unsigned int GetStitchIndice(bool upper, int along, int across) const;
+            inline int StripWinding(const unsigned int* strip, int indices) const;
+            inline void AddStripTriangles(const LODstruct& range, std::vector<unsigned int>& triangles) const;
+
+            inline void ComputeErrors();
+            inline void ComputeOccluders();
+            inline void CalcErrorLOD(Vector<3, float> viewPos, float errorScale, PatchLODState& state) const;
+            inline void CalcIncrementalLOD(Vector<3, float> viewPos, float baseDistance, float invIncDistance, 
+                                           PatchLODState& state) const;
 
             inline void SetupBoundingBox();
             inline void UpdateBoundingBox();
@@ -0,0 +1,329 @@
+// Heightfield quadtree.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include <Scene/HeightMapQuadTree.h>
+#include <Scene/HeightMapNode.h>
+#include <Scene/HeightMapPatch.h>
+#include <Scene/HeightMapLODState.h>
+#include <Meta/OpenGL.h>
+#include <Display/IViewingVolume.h>
+#include <Resources/DataBlock.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace OpenEngine::Display;
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Scene {
+
+        const float HeightMapQuadTree::MORPH_START = 0.7f;
+
+        HeightMapQuadTree::HeightMapQuadTree(HeightMapNode* terrain, HeightMapPatch** patches,
+                                             int patchGridWidth, int patchGridDepth)
+            : terrain(terrain), patches(patches),
+              patchGridWidth(patchGridWidth), patchGridDepth(patchGridDepth) {
+
+            levels = CalcLevels(patchGridWidth, patchGridDepth);
+
+            // The tree covers the vertices covered by the patches.
+            xEnd = patchGridWidth * HeightMapPatch::PATCH_EDGE_SQUARES;
+            zEnd = patchGridDepth * HeightMapPatch::PATCH_EDGE_SQUARES;
+
+            int rootSize = HeightMapPatch::PATCH_EDGE_SQUARES << (levels - 1);
+            for (int x = 0; x < xEnd; x += rootSize)
+                for (int z = 0; z < zEnd; z += rootSize)
+                    roots.push_back(BuildNode(x, z, levels - 1));
+
+            std::vector<unsigned int> indices;
+            for (unsigned int n = 0; n < nodes.size(); ++n)
+                BuildIndices(nodes[n], indices);
+            indexBuffer = IndicesPtr(new Indices(indices.size()));
+            memcpy(indexBuffer->GetData(), &indices[0], sizeof(unsigned int) * indices.size());
+
+            UpdateBoundingGeometry();
+        }
+
+        HeightMapQuadTree::~HeightMapQuadTree(){
+        }
+
+        void HeightMapQuadTree::UpdateBoundingGeometry(){
+            for (unsigned int r = 0; r < roots.size(); ++r)
+                UpdateNodeBounds(roots[r]);
+        }
+
+        int HeightMapQuadTree::CalcLevels(int patchGridWidth, int patchGridDepth){
+            // Use as few levels as possible to cover the map with one
+            // tree.
+            int gridSize = patchGridWidth > patchGridDepth ? patchGridWidth : patchGridDepth;
+            int levels = 1;
+            while ((1 << (levels - 1)) < gridSize)
+                ++levels;
+            return levels;
+        }
+
+        float HeightMapQuadTree::GetLevelRange(int level, float baseDistance, float incDistance){
+            return baseDistance + incDistance * ((2 << level) - 1);
+        }
+
+        void HeightMapQuadTree::CalcLOD(IViewingVolume* view, HeightMapLODState& state) const{
+            std::vector<Selection>& selection = state.selection;
+            selection.clear();
+            Vector<3, float> viewPos = state.GetViewPosition(view);
+            float baseDistance = terrain->GetLODBaseDistance() * state.GetDistanceScale();
+            float incDistance = terrain->GetLODIncDistance() * state.GetDistanceScale();
+            for (unsigned int r = 0; r < roots.size(); ++r)
+                Select(roots[r], view, state, viewPos, baseDistance, incDistance);
+
+            // Count what Render will draw.
+            unsigned int& triangles = state.triangleCount;
+            unsigned int& drawCalls = state.drawCallCount;
+            triangles = drawCalls = 0;
+            for (unsigned int s = 0; s < selection.size(); ++s){
+                const Node& node = nodes[selection[s].node];
+                unsigned int quadrants = selection[s].quadrants;
+                int q = 0;
+                while (q < 4){
+                    if (!(quadrants & (1 << q))){
+                        ++q;
+                        continue;
+                    }
+                    int first = q;
+                    while (q < 4 && (quadrants & (1 << q))) ++q;
+                    unsigned int indices = node.quadrantOffset[q-1] + node.quadrantIndices[q-1] - node.quadrantOffset[first];
+                    if (indices > 2){
+                        triangles += indices - 2;
+                        ++drawCalls;
+                    }
+                }
+            }
+        }
+
+        void HeightMapQuadTree::Render(const std::vector<Selection>& selection) const{
+            for (unsigned int s = 0; s < selection.size(); ++s){
+                const Node& node = nodes[selection[s].node];
+                unsigned int quadrants = selection[s].quadrants;
+
+                // Draw each run of consecutive quadrants with one
+                // call.
+                int q = 0;
+                while (q < 4){
+                    if (!(quadrants & (1 << q))){
+                        ++q;
+                        continue;
+                    }
+                    int first = q;
+                    while (q < 4 && (quadrants & (1 << q))) ++q;
+                    DrawQuadrants(node, first, q - 1);
+                }
+            }
+        }
+
+        void HeightMapQuadTree::RenderBoundingGeometry(const std::vector<Selection>& selection) const{
+            glBegin(GL_LINES);
+            glColor3f(0, 0, 1);
+            for (unsigned int s = 0; s < selection.size(); ++s){
+                const Node& node = nodes[selection[s].node];
+                Box box = GetBox(node.min, node.max);
+                for (int i = 0; i < 8; ++i){
+                    Vector<3, float> ic = box.GetCorner(i);
+                    for (int j = i+1; j < 8; ++j){
+                        Vector<3, float> jc = box.GetCorner(j);
+                        glVertex3f(ic[0], ic[1], ic[2]);
+                        glVertex3f(jc[0], jc[1], jc[2]);
+                    }
+                }
+            }
+            glEnd();
+        }
+
+        // **** inlined functions ****
+
+        int HeightMapQuadTree::BuildNode(int x, int z, int level){
+            int index = nodes.size();
+            nodes.push_back(Node());
+            Node& node = nodes.back();
+            node.x = x;
+            node.z = z;
+            node.level = level;
+            node.patch = -1;
+            for (int q = 0; q < 4; ++q){
+                node.children[q] = -1;
+                node.quadrantOffset[q] = node.quadrantIndices[q] = 0;
+            }
+
+            int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+            if (level == 0){
+                node.patch = (x / squares) * patchGridDepth + z / squares;
+                return index;
+            }
+
+            int half = (squares << level) / 2;
+            for (int q = 0; q < 4; ++q){
+                int cx = x + (q & 1) * half;
+                int cz = z + (q >> 1) * half;
+                if (cx < xEnd && cz < zEnd){
+                    // BuildNode may reallocate the nodes
+                    int child = BuildNode(cx, cz, level - 1);
+                    nodes[index].children[q] = child;
+                }
+            }
+            return index;
+        }
+
+        void HeightMapQuadTree::BuildIndices(Node& node, std::vector<unsigned int>& indices){
+            int size = HeightMapPatch::PATCH_EDGE_SQUARES << node.level;
+            int half = size / 2;
+            int step = 1 << node.level;
+
+            int previous = -1;
+            for (int q = 0; q < 4; ++q){
+                int x0 = node.x + (q & 1) * half;
+                int z0 = node.z + (q >> 1) * half;
+                int x1 = std::min(x0 + half, xEnd);
+                int z1 = std::min(z0 + half, zEnd);
+                if (x0 >= x1 || z0 >= z1){
+                    node.quadrantOffset[q] = indices.size();
+                    node.quadrantIndices[q] = 0;
+                    continue;
+                }
+
+                // Join the quadrants with degenerate triangles.
+                unsigned int first = terrain->GetIndice(x0, z1);
+                if (previous != -1){
+                    indices.push_back(indices.back());
+                    indices.push_back(first);
+                }
+
+                node.quadrantOffset[q] = indices.size();
+                AppendGrid(x0, z0, x1, z1, step, indices);
+                node.quadrantIndices[q] = indices.size() - node.quadrantOffset[q];
+                previous = q;
+            }
+        }
+
+        void HeightMapQuadTree::AppendGrid(int x0, int z0, int x1, int z1, int step,
+                                           std::vector<unsigned int>& indices){
+            // The grid lines, where the last one is moved to the edge
+            // of the tree if the step doesn't fit.
+            std::vector<int> xs, zs;
+            for (int x = x0; x < x1; x += step) xs.push_back(x);
+            xs.push_back(x1);
+            for (int z = z0; z < z1; z += step) zs.push_back(z);
+            zs.push_back(z1);
+
+            // Strips along z with degenerate triangles between them,
+            // like the patch bodies.
+            for (unsigned int i = 0; i + 1 < xs.size(); ++i){
+                if (i > 0){
+                    indices.push_back(terrain->GetIndice(xs[i], zs.front()));
+                    indices.push_back(terrain->GetIndice(xs[i], zs.back()));
+                }
+                for (int j = zs.size() - 1; j >= 0; --j){
+                    indices.push_back(terrain->GetIndice(xs[i], zs[j]));
+                    indices.push_back(terrain->GetIndice(xs[i+1], zs[j]));
+                }
+            }
+        }
+
+        void HeightMapQuadTree::UpdateNodeBounds(int n){
+            Node& node = nodes[n];
+            if (node.patch != -1){
+                HeightMapPatch* patch = patches[node.patch];
+                int squares = HeightMapPatch::PATCH_EDGE_SQUARES;
+                float* lower = terrain->GetVertex(node.x, node.z);
+                float* upper = terrain->GetVertex(node.x + squares, node.z + squares);
+                node.min = Vector<3, float>(lower[0], patch->GetMinHeight(), lower[2]);
+                node.max = Vector<3, float>(upper[0], patch->GetMaxHeight(), upper[2]);
+                return;
+            }
+
+            bool first = true;
+            for (int q = 0; q < 4; ++q){
+                int c = node.children[q];
+                if (c == -1) continue;
+                UpdateNodeBounds(c);
+                // The children may have been moved by the update
+                const Node& child = nodes[c];
+                if (first){
+                    nodes[n].min = child.min;
+                    nodes[n].max = child.max;
+                    first = false;
+                }else
+                    for (int i = 0; i < 3; ++i){
+                        nodes[n].min[i] = std::min(nodes[n].min[i], child.min[i]);
+                        nodes[n].max[i] = std::max(nodes[n].max[i], child.max[i]);
+                    }
+            }
+        }
+
+        void HeightMapQuadTree::Select(int n, IViewingVolume* view, HeightMapLODState& state, 
+                                       Vector<3, float> viewPos, float baseDistance, float incDistance) const{
+            const Node& node = nodes[n];
+            if (!state.IsVisible(view, node.min, node.max)) return;
+
+            Selection sel;
+            sel.node = n;
+            sel.quadrants = 0xF;
+
+            if (node.level == 0 ||
+                GetDistance(viewPos, node.min, node.max) > GetLevelRange(node.level - 1, baseDistance, incDistance)){
+                // Close enough to be drawn at this level.
+                state.selection.push_back(sel);
+                return;
+            }
+
+            // Split the quadrants within the range of the children,
+            // draw the rest from this node.
+            float childRange = GetLevelRange(node.level - 1, baseDistance, incDistance);
+            sel.quadrants = 0;
+            for (int q = 0; q < 4; ++q){
+                int c = node.children[q];
+                if (c == -1) continue;
+                const Node& child = nodes[c];
+                if (GetDistance(viewPos, child.min, child.max) <= childRange)
+                    Select(c, view, state, viewPos, baseDistance, incDistance);
+                else if (state.IsVisible(view, child.min, child.max))
+                    sel.quadrants |= 1 << q;
+            }
+            if (sel.quadrants)
+                state.selection.push_back(sel);
+        }
+
+        Box HeightMapQuadTree::GetBox(const Vector<3, float>& min, const Vector<3, float>& max) const{
+            Vector<3, float> center = (min + max) / 2;
+            return Box(center, max - center);
+        }
+
+        float HeightMapQuadTree::GetDistance(const Vector<3, float>& point,
+                                             const Vector<3, float>& min, const Vector<3, float>& max) const{
+            float distance = 0.0f;
+            for (int i = 0; i < 3; ++i){
+                float d = 0.0f;
+                if (point[i] < min[i]) d = min[i] - point[i];
+                else if (point[i] > max[i]) d = point[i] - max[i];
+                distance += d * d;
+            }
+            return sqrt(distance);
+        }
+
+        void HeightMapQuadTree::DrawQuadrants(const Node& node, int first, int last) const{
+            unsigned int offset = node.quadrantOffset[first];
+            unsigned int end = node.quadrantOffset[last] + node.quadrantIndices[last];
+            if (end <= offset) return;
+            if (indexBuffer->GetID() != 0)
+                glDrawElements(GL_TRIANGLE_STRIP, end - offset, GL_UNSIGNED_INT, (void*)(offset * sizeof(GLuint)));
+            else
+                glDrawElements(GL_TRIANGLE_STRIP, end - offset, GL_UNSIGNED_INT, indexBuffer->GetData() + offset);
+        }
+
+    }
+}
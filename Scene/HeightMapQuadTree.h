@@ -0,0 +1,149 @@
+// Heightfield quadtree.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTFIELD_QUADTREE_H_
+#define _HEIGHTFIELD_QUADTREE_H_
+
+#include <Geometry/Box.h>
+#include <Math/Vector.h>
+
+#include <vector>
+
+using namespace OpenEngine::Geometry;
+
+namespace OpenEngine {
+    namespace Resources {
+        class Indices;
+        typedef boost::shared_ptr<Indices > IndicesPtr;
+    }
+    namespace Display{
+        class IViewingVolume;
+    }
+    namespace Scene {
+        class HeightMapNode;
+        class HeightMapPatch;
+        class HeightMapLODState;
+
+        /**
+         * Continuous distance dependent LOD, see
+         * http://www.vertexasylum.com/downloads/cdlod/cdlod_latest.pdf
+         *
+         * The leaves of the quadtree are the heightmap patches. A
+         * node at level L covers 2^L x 2^L patches with a grid of
+         * PATCH_EDGE_SQUARES^2 squares, sampling every 2^L'th
+         * vertex. The number of levels follows the map size, so a
+         * single tree covers the map.
+         *
+         * Level L is used up to the distance
+         *
+         *   range(L) = base + inc * (2^(L+1) - 1)
+         *
+         * so the ranges grow with the node sizes. A node is split
+         * into its children where they are closer than the range of
+         * the level below, and the quadrants that aren't split are
+         * drawn from the node itself. The vertices are morphed
+         * towards the next level over the last part of their range,
+         * which keeps neighbouring nodes of different levels free of
+         * cracks.
+         */
+        class HeightMapQuadTree {
+        public:
+            /**
+             * The fraction of a level's range where the vertices
+             * start morphing towards the next level.
+             */
+            static const float MORPH_START;
+
+            /**
+             * A node to draw and the quadrants to draw it with.
+             */
+            struct Selection {
+                int node;
+                unsigned int quadrants; // bitmask of quadrants to draw
+            };
+
+        protected:
+            struct Node {
+                int x, z;       // lower corner in vertex coords
+                int level;
+                int children[4]; // -1 if outside the map
+                int patch;       // leaf patch, -1 for inner nodes
+                Vector<3, float> min, max;
+                // Index strips of the quadrants, stored consecutively
+                // with degenerate triangles between them, so the
+                // entire node can be drawn with one call.
+                unsigned int quadrantOffset[4];
+                unsigned int quadrantIndices[4];
+            };
+
+            HeightMapNode* terrain;
+            HeightMapPatch** patches;
+            int patchGridWidth, patchGridDepth;
+            int xEnd, zEnd; // the last vertex covered
+            int levels;
+
+            std::vector<Node> nodes;
+            std::vector<int> roots;
+            Resources::IndicesPtr indexBuffer;
+
+        public:
+            HeightMapQuadTree(HeightMapNode* terrain, HeightMapPatch** patches,
+                              int patchGridWidth, int patchGridDepth);
+            ~HeightMapQuadTree();
+
+            /**
+             * Recomputes the node bounds from the patches, fx after
+             * the heights have changed.
+             */
+            void UpdateBoundingGeometry();
+
+            /**
+             * Selects the nodes to draw for the view into the state
+             * and counts the strip triangles and draw calls Render
+             * will use. The tree isn't changed, so different views
+             * can be selected concurrently.
+             */
+            void CalcLOD(Display::IViewingVolume* view, HeightMapLODState& state) const;
+            void Render(const std::vector<Selection>& selection) const;
+            void RenderBoundingGeometry(const std::vector<Selection>& selection) const;
+
+            // *** Get/Set methods ***
+
+            int GetLevels() const { return levels; }
+            Resources::IndicesPtr GetIndices() const { return indexBuffer; }
+
+            /**
+             * The number of levels needed to cover a grid of patches
+             * with one tree.
+             */
+            static int CalcLevels(int patchGridWidth, int patchGridDepth);
+
+            /**
+             * The distance up to which the given level is used.
+             */
+            static float GetLevelRange(int level, float baseDistance, float incDistance);
+
+        protected:
+            inline int BuildNode(int x, int z, int level);
+            inline void BuildIndices(Node& node, std::vector<unsigned int>& indices);
+            inline void AppendGrid(int x0, int z0, int x1, int z1, int step,
+                                   std::vector<unsigned int>& indices);
+            inline void UpdateNodeBounds(int node);
+            inline void Select(int node, Display::IViewingVolume* view, HeightMapLODState& state, 
+                               Vector<3, float> viewPos, float baseDistance, float incDistance) const;
+            inline Box GetBox(const Vector<3, float>& min, const Vector<3, float>& max) const;
+            inline float GetDistance(const Vector<3, float>& point,
+                                     const Vector<3, float>& min, const Vector<3, float>& max) const;
+            inline void DrawQuadrants(const Node& node, int first, int last) const;
+        };
+
+    }
+}
+
+#endif
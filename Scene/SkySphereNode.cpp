@@ -9,11 +9,17 @@
 
 #include <Scene/SkySphereNode.h>
 
+#include <Scene/SunNode.h>
 #include <Geometry/Mesh.h>
 #include <Resources/IShaderResource.h>
 #include <Utils/MeshCreator.h>
+#include <Meta/OpenGL.h>
+#include <Math/Math.h>
+
+#include <algorithm>
 
 using namespace OpenEngine::Geometry;
+using namespace OpenEngine::Math;
 using namespace OpenEngine::Resources;
 using namespace OpenEngine::Renderers;
 using namespace OpenEngine::Utils::MeshCreator;
@@ -21,8 +27,65 @@ using namespace OpenEngine::Utils::MeshCreator;
 namespace OpenEngine {
     namespace Scene {
 
+        // Earth like atmosphere in kilometers, see Bruneton and
+        // Neyret, Precomputed Atmospheric Scattering, 2008.
+        static const float GROUND_RADIUS = 6360.0f;
+        static const float TOP_RADIUS = 6420.0f;
+        static const float ATMOSPHERE_HEIGHT = TOP_RADIUS - GROUND_RADIUS;
+        static const float RAYLEIGH_HEIGHT = 8.0f;
+        static const float MIE_HEIGHT = 1.2f;
+        static const float RAYLEIGH_BETA[3] = {5.8e-3f, 13.5e-3f, 33.1e-3f};
+        static const float MIE_BETA = 4e-3f;
+        static const float MIE_EXTINCTION = MIE_BETA / 0.9f;
+
+        static const int TRANSMITTANCE_SAMPLES = 64;
+        static const int INSCATTER_SAMPLES = 32;
+        // The change in sun zenith cosine that recomputes the
+        // inscatter.
+        static const float SUN_EPSILON = 0.005f;
+
+        /**
+         * The distance from radius r along the zenith cosine mu to
+         * the top of the atmosphere, or to the ground if the ray
+         * hits it.
+         */
+        static float RayLength(float r, float mu, bool& ground){
+            float d = r * r * (mu * mu - 1.0f);
+            ground = mu < 0.0f && d + GROUND_RADIUS * GROUND_RADIUS >= 0.0f;
+            if (ground)
+                return -r * mu - sqrt(d + GROUND_RADIUS * GROUND_RADIUS);
+            return -r * mu + sqrt(std::max(d + TOP_RADIUS * TOP_RADIUS, 0.0f));
+        }
+
+        /**
+         * Bilinear lookup in the transmittance table, 0 if the ray
+         * hits the ground.
+         */
+        static void LookupTransmittance(const float* table, float r, float mu, float* rgb){
+            bool ground;
+            RayLength(r, mu, ground);
+            if (ground){
+                rgb[0] = rgb[1] = rgb[2] = 0.0f;
+                return;
+            }
+            const int W = SkySphereNode::TRANSMITTANCE_MU;
+            const int H = SkySphereNode::TRANSMITTANCE_HEIGHTS;
+            float h = std::min(std::max(r - GROUND_RADIUS, 0.0f), ATMOSPHERE_HEIGHT);
+            float s = (mu * 0.5f + 0.5f) * (W - 1);
+            float t = sqrt(h / ATMOSPHERE_HEIGHT) * (H - 1);
+            int s0 = std::min(int(s), W - 2), t0 = std::min(int(t), H - 2);
+            float ds = s - s0, dt = t - t0;
+            for (int c = 0; c < 3; ++c){
+                const float* p = table + (s0 + t0 * W) * 3 + c;
+                rgb[c] = (p[0] * (1 - ds) + p[3] * ds) * (1 - dt) + 
+                    (p[W * 3] * (1 - ds) + p[W * 3 + 3] * ds) * dt;
+            }
+        }
+
         SkySphereNode::SkySphereNode(Resources::IShaderResourcePtr atmos, float radius, unsigned int detail) 
-            : skySphere(CreateSphere(radius, detail, Vector<3, float>(0,0,0), true)), atmosphere(atmos) {
+            : skySphere(CreateSphere(radius, detail, Vector<3, float>(0,0,0), true)), atmosphere(atmos),
+              sun(NULL), precomputed(false), unitScale(0.001f), 
+              inscatterSunCos(2.0f), inscatterUpdates(0) {
             
             skySphere->GetMaterial()->shad = atmosphere;
 
@@ -30,9 +93,156 @@ namespace OpenEngine {
 
         void SkySphereNode::Handle(RenderingEventArg arg){
             if (atmosphere != NULL){
+                if (precomputed){
+                    ComputeTransmittance();
+                    ComputeInscatter(GetSunDirection().Get(1));
+
+                    atmosphere->SetTexture("transmittance", (ITexture2DPtr)transmittance);
+                    atmosphere->SetTexture("inscatter", (ITexture2DPtr)inscatter);
+                    atmosphere->SetUniform("atmosphereRadii", Vector<2, float>(GROUND_RADIUS, TOP_RADIUS));
+                    atmosphere->SetUniform("unitScale", unitScale);
+                    arg.renderer.LoadTexture(transmittance.get());
+                    arg.renderer.LoadTexture(inscatter.get());
+                }
                 atmosphere->Load();
             }
         }
 
+        Vector<3, float> SkySphereNode::GetSunDirection() const{
+            if (sun != NULL){
+                Vector<3, float> dir = sun->GetPos();
+                if (dir.GetLengthSquared() > 0.0f)
+                    return dir.GetNormalize();
+            }
+            return Vector<3, float>(-1,0.3,0).GetNormalize();
+        }
+
+        void SkySphereNode::SetPrecomputedScattering(const bool precompute, const float unitScale){
+            precomputed = precompute;
+            this->unitScale = unitScale;
+        }
+
+        bool SkySphereNode::UpdateScattering(const Vector<3, float> sunDir){
+            if (!precomputed || transmittance == NULL) return false;
+            if (fabs(sunDir.Get(1) - inscatterSunCos) < SUN_EPSILON) return false;
+
+            ComputeInscatter(sunDir.Get(1));
+
+            if (inscatter->GetID() != 0){
+                glBindTexture(GL_TEXTURE_2D, inscatter->GetID());
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 
+                                inscatter->GetWidth(), inscatter->GetHeight(), 
+                                GL_RGBA, GL_FLOAT, inscatter->GetVoidDataPtr());
+                glBindTexture(GL_TEXTURE_2D, 0);
+            }
+            return true;
+        }
+
+        void SkySphereNode::ComputeTransmittance(){
+            const int W = TRANSMITTANCE_MU, H = TRANSMITTANCE_HEIGHTS;
+            if (transmittance == NULL){
+                transmittance = FloatTexture2DPtr(new Texture2D<float>(W, H, 3, new float[W * H * 3]));
+                transmittance->SetColorFormat(RGB32F);
+                transmittance->SetWrapping(CLAMP_TO_EDGE);
+                transmittance->SetMipmapping(false);
+                transmittance->SetCompression(false);
+            }
+            float* data = transmittance->GetData();
+
+            // The optical depth to the top of the atmosphere, the
+            // rows are independent.
+#pragma omp parallel for
+            for (int t = 0; t < H; ++t){
+                float h = float(t) / (H - 1);
+                float r = GROUND_RADIUS + h * h * ATMOSPHERE_HEIGHT;
+                for (int s = 0; s < W; ++s){
+                    float mu = float(s) / (W - 1) * 2.0f - 1.0f;
+                    bool ground;
+                    float length = RayLength(r, mu, ground);
+                    float dx = length / TRANSMITTANCE_SAMPLES;
+                    float rayleigh = 0.0f, mie = 0.0f;
+                    for (int i = 0; i < TRANSMITTANCE_SAMPLES; ++i){
+                        float x = (i + 0.5f) * dx;
+                        float ri = sqrt(r * r + x * x + 2.0f * x * r * mu);
+                        float hi = std::max(ri - GROUND_RADIUS, 0.0f);
+                        rayleigh += exp(-hi / RAYLEIGH_HEIGHT) * dx;
+                        mie += exp(-hi / MIE_HEIGHT) * dx;
+                    }
+                    float* texel = data + (s + t * W) * 3;
+                    for (int c = 0; c < 3; ++c)
+                        texel[c] = exp(-(RAYLEIGH_BETA[c] * rayleigh + MIE_EXTINCTION * mie));
+                }
+            }
+        }
+
+        void SkySphereNode::ComputeInscatter(const float sunCos){
+            const int MU = INSCATTER_MU, PHI = INSCATTER_AZIMUTHS, HEIGHTS = INSCATTER_HEIGHTS;
+            const int W = MU * HEIGHTS;
+            if (inscatter == NULL){
+                inscatter = FloatTexture2DPtr(new Texture2D<float>(W, PHI, 4, new float[W * PHI * 4]));
+                inscatter->SetColorFormat(RGBA32F);
+                inscatter->SetWrapping(CLAMP_TO_EDGE);
+                inscatter->SetMipmapping(false);
+                inscatter->SetCompression(false);
+            }
+            float* data = inscatter->GetData();
+            const float* trans = transmittance->GetData();
+
+            float muS = std::min(std::max(sunCos, -1.0f), 1.0f);
+            Vector<3, float> sunDir(sqrt(1.0f - muS * muS), muS, 0.0f);
+
+            // Single scattering along every view ray, each texel is
+            // independent.
+#pragma omp parallel for
+            for (int y = 0; y < PHI; ++y){
+                float phi = float(y) / (PHI - 1) * PI;
+                for (int x = 0; x < W; ++x){
+                    int slice = x / MU;
+                    float h = float(slice) / (HEIGHTS - 1);
+                    float r = GROUND_RADIUS + h * h * ATMOSPHERE_HEIGHT;
+                    float mu = float(x % MU) / (MU - 1) * 2.0f - 1.0f;
+                    float sinTheta = sqrt(std::max(1.0f - mu * mu, 0.0f));
+                    Vector<3, float> dir(sinTheta * cos(phi), mu, sinTheta * sin(phi));
+
+                    bool ground;
+                    float length = RayLength(r, mu, ground);
+                    float dx = length / INSCATTER_SAMPLES;
+
+                    // The optical depth from the view accumulates
+                    // along the ray.
+                    float rayleigh[3] = {0.0f, 0.0f, 0.0f};
+                    float mie = 0.0f;
+                    float depthR = 0.0f, depthM = 0.0f;
+                    for (int i = 0; i < INSCATTER_SAMPLES; ++i){
+                        float t = (i + 0.5f) * dx;
+                        Vector<3, float> p = Vector<3, float>(0.0f, r, 0.0f) + dir * t;
+                        float ri = p.GetLength();
+                        float hi = std::max(ri - GROUND_RADIUS, 0.0f);
+                        float densityR = exp(-hi / RAYLEIGH_HEIGHT);
+                        float densityM = exp(-hi / MIE_HEIGHT);
+                        depthR += densityR * dx;
+                        depthM += densityM * dx;
+
+                        float sunTrans[3];
+                        LookupTransmittance(trans, ri, (p * sunDir) / ri, sunTrans);
+                        for (int c = 0; c < 3; ++c){
+                            float viewTrans = exp(-(RAYLEIGH_BETA[c] * depthR + MIE_EXTINCTION * depthM));
+                            float light = viewTrans * sunTrans[c] * dx;
+                            rayleigh[c] += densityR * light;
+                            if (c == 0) mie += densityM * light;
+                        }
+                    }
+
+                    float* texel = data + (x + y * W) * 4;
+                    for (int c = 0; c < 3; ++c)
+                        texel[c] = rayleigh[c] * RAYLEIGH_BETA[c];
+                    texel[3] = mie * MIE_BETA;
+                }
+            }
+
+            inscatterSunCos = sunCos;
+            ++inscatterUpdates;
+        }
+
     }
 }
@@ -13,6 +13,8 @@
 #include <Scene/ISceneNode.h>
 #include <Core/IListener.h>
 #include <Renderers/IRenderer.h>
+#include <Resources/Texture2D.h>
+#include <Math/Vector.h>
 
 #include <boost/shared_ptr.hpp>
 
@@ -26,24 +28,101 @@ namespace OpenEngine {
         typedef boost::shared_ptr<IShaderResource> IShaderResourcePtr;
     }
     namespace Scene {
+        class SunNode;
         
+        /**
+         * A sky dome rendered with an atmosphere shader.
+         *
+         * The scattering can be precomputed into lookup tables, so
+         * the shader only does table lookups. The tables are bound
+         * to the shader as
+         *
+         * "transmittance", RGB, the transmittance from a height
+         * (texture t, sqrt of the height over the atmosphere height)
+         * along a direction (texture s, zenith cosine from -1 to 1)
+         * to the top of the atmosphere.
+         *
+         * "inscatter", RGBA, the single scattered Rayleigh light in
+         * RGB and Mie light in red in A, without the phase functions,
+         * for the current sun. The INSCATTER_HEIGHTS height slices
+         * are laid out side by side, each INSCATTER_MU wide, the view
+         * zenith cosine from -1 to 1. Texture t is the azimuth
+         * between the view and the sun from 0 to pi.
+         *
+         * "atmosphereRadii" holds the planet and atmosphere radius
+         * and "unitScale" the kilometers per world unit.
+         */
         class SkySphereNode : public ISceneNode, 
                               public Core::IListener<Renderers::RenderingEventArg> {
             
             OE_SCENE_NODE(SkySphereNode, ISceneNode)
+        public:
+            static const int TRANSMITTANCE_MU = 64;
+            static const int TRANSMITTANCE_HEIGHTS = 32;
+            static const int INSCATTER_MU = 64;
+            static const int INSCATTER_AZIMUTHS = 32;
+            static const int INSCATTER_HEIGHTS = 16;
+
         protected:
             Geometry::MeshPtr skySphere;
             Resources::IShaderResourcePtr atmosphere;
 
+            SunNode* sun;
+
+            // Precomputed scattering
+            bool precomputed;
+            float unitScale;
+            Resources::FloatTexture2DPtr transmittance;
+            Resources::FloatTexture2DPtr inscatter;
+            // The sun zenith cosine the inscatter was computed for
+            float inscatterSunCos;
+            unsigned int inscatterUpdates;
+
         public:
-            SkySphereNode() {}
+            SkySphereNode() : sun(NULL), precomputed(false) {}
             SkySphereNode(Resources::IShaderResourcePtr atmos, float radius, unsigned int detail);
             
             void Handle(Renderers::RenderingEventArg arg);
 
             inline Geometry::MeshPtr GetMesh() const { return skySphere; }
             inline Resources::IShaderResourcePtr GetAtmostphereShader() const { return atmosphere; }
-            
+
+            /**
+             * Lights the sky from the sun. Without a sun the light
+             * comes from the fixed direction (-1, 0.3, 0).
+             */
+            void SetSunNode(SunNode* sun) { this->sun = sun; }
+            inline SunNode* GetSunNode() const { return sun; }
+            /**
+             * The normalized direction towards the sun.
+             */
+            Math::Vector<3, float> GetSunDirection() const;
+
+            /**
+             * Precomputes the scattering into lookup tables. The
+             * transmittance is computed when the sky is initialized,
+             * the inscatter then and whenever the sun has moved, see
+             * UpdateScattering. Must be set before the sky is
+             * initialized.
+             *
+             * @param unitScale Kilometers per world unit.
+             */
+            void SetPrecomputedScattering(const bool precompute, const float unitScale = 0.001f);
+            inline bool IsPrecomputedScattering() const { return precomputed; }
+            /**
+             * Recomputes the inscatter table if the sun elevation has
+             * changed noticeably and uploads it.
+             *
+             * @return True if the table was recomputed.
+             */
+            bool UpdateScattering(const Math::Vector<3, float> sunDir);
+            inline Resources::FloatTexture2DPtr GetTransmittanceTable() const { return transmittance; }
+            inline Resources::FloatTexture2DPtr GetInscatterTable() const { return inscatter; }
+            inline unsigned int GetInscatterUpdates() const { return inscatterUpdates; }
+
+        protected:
+            inline void ComputeTransmittance();
+            inline void ComputeInscatter(const float sunCos);
         };
 
     }
@@ -11,32 +11,60 @@
 
 #include <Resources/IShaderResource.h>
 #include <Resources/FrameBuffer.h>
+#include <Display/IViewingVolume.h>
 #include <Utils/TerrainTexUtils.h>
 #include <Logging/Logger.h>
 #include <string.h>
+#include <vector>
 
 using namespace std;
+using namespace OpenEngine::Display;
 
 namespace OpenEngine {
     namespace Scene {
 
+        // Reflection buffers no longer used by any water, kept for
+        // reuse.
+        static const unsigned int MAX_POOLED_FBOS = 4;
+        static vector<FrameBuffer*> fboPool;
+
+        static FrameBuffer* AcquireFbo(Vector<2, int> dim, IRenderer& renderer){
+            for (unsigned int i = 0; i < fboPool.size(); ++i)
+                if (fboPool[i]->GetDimension() == dim){
+                    FrameBuffer* fbo = fboPool[i];
+                    fboPool.erase(fboPool.begin() + i);
+                    return fbo;
+                }
+            FrameBuffer* fbo = new FrameBuffer(dim, 1, false);
+            renderer.BindFrameBuffer(fbo);
+            return fbo;
+        }
+
+        static void ReleaseFbo(FrameBuffer* fbo){
+            if (fbo == NULL) return;
+            fboPool.push_back(fbo);
+            if (fboPool.size() > MAX_POOLED_FBOS){
+                delete fboPool.front();
+                fboPool.erase(fboPool.begin());
+            }
+        }
+
         WaterNode::WaterNode(Vector<3, float> c, float d)
             : center(c), diameter(d), planetDiameter(1000),
+              reflectionFbo(NULL), reflectionDim(400, 300), 
+              updateInterval(1), moveThreshold(0.0f), rotateThreshold(0.0f),
+              framesSinceUpdate(0), reflectionUpdates(0), reflectionValid(false),
               waterShader(IShaderResourcePtr()), elapsedTime(0) {
             SetupArrays();
         }
 
         WaterNode::~WaterNode(){
-            
+            ReleaseFbo(reflectionFbo);
         }
 
         void WaterNode::Handle(RenderingEventArg arg){
             if (waterShader != NULL){
-                Vector<2, int> dim(400,300);
-                reflectionFbo = new FrameBuffer(dim, 1, false);
-                arg.renderer.BindFrameBuffer(reflectionFbo);
-                
-                waterShader->SetTexture("reflection", reflectionFbo->GetTexAttachment(0));
+                SetupReflectionFbo(arg);
 
                 if (normaldudvmap != NULL)
                     waterShader->SetTexture("normaldudvmap", (ITexture2DPtr)normaldudvmap);
@@ -60,6 +88,50 @@ namespace OpenEngine {
             SetupTexCoords();
         }
 
+        void WaterNode::SetReflectionResolution(const Vector<2, int> dim){
+            if (dim[0] <= 0 || dim[1] <= 0){
+                logger.warning << "Invalid reflection resolution " << dim << logger.end;
+                return;
+            }
+            reflectionDim = dim;
+        }
+
+        void WaterNode::SetReflectionUpdate(const unsigned int frames, const float distance, const float angle){
+            updateInterval = frames;
+            moveThreshold = distance < 0.0f ? 0.0f : distance;
+            rotateThreshold = angle < 0.0f ? 0.0f : angle;
+        }
+
+        bool WaterNode::UpdateReflection(RenderingEventArg arg){
+            if (reflectionFbo == NULL || !(reflectionFbo->GetDimension() == reflectionDim))
+                SetupReflectionFbo(arg);
+
+            IViewingVolume* view = arg.canvas.GetViewingVolume();
+            Vector<3, float> viewPos = view->GetPosition();
+            Vector<3, float> viewDir = view->GetDirection().RotateVector(Vector<3, float>(0, 0, 1));
+
+            ++framesSinceUpdate;
+            bool update = !reflectionValid;
+            if (updateInterval > 0 && framesSinceUpdate >= updateInterval)
+                update = true;
+            if (moveThreshold > 0.0f && 
+                (viewPos - reflectionViewPos).GetLengthSquared() > moveThreshold * moveThreshold)
+                update = true;
+            if (rotateThreshold > 0.0f){
+                float cosAngle = viewDir * reflectionViewDir;
+                if (cosAngle < cos(rotateThreshold))
+                    update = true;
+            }
+            if (!update) return false;
+
+            framesSinceUpdate = 0;
+            reflectionValid = true;
+            reflectionViewPos = viewPos;
+            reflectionViewDir = viewDir;
+            ++reflectionUpdates;
+            return true;
+        }
+
         void WaterNode::SetNormalDudvMap(UCharTexture2DPtr normal, UCharTexture2DPtr dudv){
             if (normal != NULL && dudv != NULL){
                 normal->Load();
@@ -97,6 +169,15 @@ namespace OpenEngine {
             SetupTexCoords();
         }
         
+        void WaterNode::SetupReflectionFbo(RenderingEventArg arg){
+            // Return the old buffer, the shader must sample the new
+            // one and it must be rendered before it is used.
+            ReleaseFbo(reflectionFbo);
+            reflectionFbo = AcquireFbo(reflectionDim, arg.renderer);
+            waterShader->SetTexture("reflection", reflectionFbo->GetTexAttachment(0));
+            reflectionValid = false;
+        }
+
         void WaterNode::SetupArrays(){
             entries = SLICES + 2;
             
@@ -60,12 +60,19 @@ namespace OpenEngine {
             float planetDiameter;
 
             FrameBuffer* reflectionFbo;
+            // Reflection update policy
+            Vector<2, int> reflectionDim;
+            unsigned int updateInterval;
+            float moveThreshold, rotateThreshold;
+            unsigned int framesSinceUpdate, reflectionUpdates;
+            bool reflectionValid;
+            Vector<3, float> reflectionViewPos, reflectionViewDir;
 
             IShaderResourcePtr waterShader;
             unsigned int elapsedTime;
 
         public:
-            WaterNode() {}
+            WaterNode() : reflectionFbo(NULL) {}
             WaterNode(Vector<3, float> c, float d);
             ~WaterNode();
 
@@ -86,6 +93,35 @@ namespace OpenEngine {
             float* GetTextureCoordArray() const { return texCoords; }
 
             FrameBuffer* GetReflectionFbo() const { return reflectionFbo; }
+            /**
+             * Sets the size of the reflection texture. The buffers
+             * are shared with other water nodes through a small
+             * pool, so changing the size back and forth is cheap.
+             */
+            void SetReflectionResolution(const Vector<2, int> dim);
+            Vector<2, int> GetReflectionResolution() const { return reflectionDim; }
+            /**
+             * Sets when the reflection is rendered again. It is
+             * rendered every frames'th frame, or as soon as the view
+             * has moved more than the distance or turned more than
+             * the angle in radians since the last update. 0 disables
+             * a condition. The default updates every frame.
+             */
+            void SetReflectionUpdate(const unsigned int frames, const float distance = 0.0f, const float angle = 0.0f);
+            unsigned int GetReflectionUpdateInterval() const { return updateInterval; }
+            /**
+             * Called by the renderer once per frame before the
+             * reflection would be rendered. Resizes the reflection
+             * buffer if needed.
+             *
+             * @return True if the reflection should be rendered this
+             * frame.
+             */
+            bool UpdateReflection(RenderingEventArg arg);
+            /**
+             * The number of times the reflection has been rendered.
+             */
+            unsigned int GetReflectionUpdates() const { return reflectionUpdates; }
             unsigned int GetElapsedTime() { return elapsedTime; }
 
             void SetNormalDudvMap(UCharTexture2DPtr normal, UCharTexture2DPtr dudv);
@@ -95,6 +131,7 @@ namespace OpenEngine {
             IShaderResourcePtr GetWaterShader() { return waterShader; }
 
         private:
+            inline void SetupReflectionFbo(RenderingEventArg arg);
             inline void SetupArrays();
             inline void SetupTexCoords();
         };
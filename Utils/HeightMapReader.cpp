@@ -0,0 +1,148 @@
+// Heightmap file reader.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include <Utils/HeightMapReader.h>
+#include <Utils/TerrainTexUtils.h>
+#include <Resources/Exceptions.h>
+
+#include <cctype>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        static bool IsLittleEndian(){
+            unsigned short one = 1;
+            return *(unsigned char*)&one == 1;
+        }
+
+        /**
+         * Reads the next whitespace separated number of a PGM
+         * header, skipping comments.
+         */
+        static bool ReadHeaderValue(FILE* file, unsigned int& value){
+            int c = fgetc(file);
+            while (c != EOF){
+                if (c == '#')
+                    while (c != EOF && c != '\n') c = fgetc(file);
+                else if (isspace(c))
+                    c = fgetc(file);
+                else break;
+            }
+            if (c == EOF || !isdigit(c)) return false;
+            value = 0;
+            while (c != EOF && isdigit(c)){
+                value = value * 10 + (c - '0');
+                c = fgetc(file);
+            }
+            // The single whitespace after the value is consumed.
+            return c != EOF && isspace(c);
+        }
+
+        HeightMapReader::HeightMapReader(const std::string file)
+            : filename(file), file(NULL), byteOrder(BIG_ENDIAN_ORDER) {
+            Open();
+
+            char magic[2];
+            unsigned int maxval;
+            if (fread(magic, 1, 2, this->file) != 2 || magic[0] != 'P' || magic[1] != '5' ||
+                !ReadHeaderValue(this->file, width) || !ReadHeaderValue(this->file, height) ||
+                !ReadHeaderValue(this->file, maxval) || maxval == 0 || maxval > 65535){
+                fclose(this->file);
+                throw ResourceException("Not a binary PGM file: " + filename);
+            }
+            maxValue = maxval;
+            bytesPerSample = maxValue < 256 ? 1 : 2;
+            dataOffset = ftell(this->file);
+            row.resize(width * bytesPerSample);
+        }
+
+        HeightMapReader::HeightMapReader(const std::string file, unsigned int width, unsigned int height,
+                                         unsigned int bytesPerSample, ByteOrder order)
+            : filename(file), file(NULL), width(width), height(height),
+              bytesPerSample(bytesPerSample == 1 ? 1 : 2), byteOrder(order), dataOffset(0) {
+            Open();
+            maxValue = this->bytesPerSample == 1 ? 255 : 65535;
+            row.resize(width * this->bytesPerSample);
+
+            // Check that the file holds all the samples.
+            long long size = (long long)width * height * this->bytesPerSample;
+            Seek(size - 1);
+            if (size > 0 && fgetc(this->file) == EOF){
+                fclose(this->file);
+                throw ResourceException("RAW heightmap is smaller than its dimensions: " + filename);
+            }
+        }
+
+        HeightMapReader::~HeightMapReader(){
+            if (file != NULL) fclose(file);
+        }
+
+        void HeightMapReader::Open(){
+            file = fopen(filename.c_str(), "rb");
+            if (file == NULL)
+                throw ResourceException("Could not open heightmap: " + filename);
+        }
+
+        void HeightMapReader::Seek(long long position){
+#ifdef _WIN32
+            _fseeki64(file, position, SEEK_SET);
+#else
+            fseeko(file, (off_t)position, SEEK_SET);
+#endif
+        }
+
+        void HeightMapReader::ReadRow(unsigned int y, unsigned int x, unsigned int count,
+                                      float* dst, float scale, float offset){
+            if (y >= height || x + count > width)
+                throw ResourceException("Heightmap read outside of " + filename);
+            if (count == 0) return;
+
+            Seek(dataOffset + ((long long)y * width + x) * bytesPerSample);
+            if (fread(&row[0], bytesPerSample, count, file) != count)
+                throw ResourceException("Unexpected end of heightmap: " + filename);
+
+            if (bytesPerSample == 1){
+                ScaleSamples(&row[0], 1, dst, count, scale, offset);
+            }else{
+                unsigned short* samples = (unsigned short*)&row[0];
+                if ((byteOrder == LITTLE_ENDIAN_ORDER) != IsLittleEndian())
+                    for (unsigned int i = 0; i < count; ++i)
+                        samples[i] = (samples[i] >> 8) | (samples[i] << 8);
+                ScaleSamples(samples, 1, dst, count, scale, offset);
+            }
+        }
+
+        FloatTexture2DPtr HeightMapReader::Read(float scale, float offset){
+            return Read(0, 0, width, height, scale, offset);
+        }
+
+        FloatTexture2DPtr HeightMapReader::Read(unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+                                                float scale, float offset){
+            FloatTexture2DPtr ret = FloatTexture2DPtr(new FloatTexture2D(w, h, LUMINANCE32F));
+            ret->SetWrapping(CLAMP_TO_EDGE);
+            ret->Load();
+            Read(ret, 0, 0, x, y, w, h, scale, offset);
+            return ret;
+        }
+
+        void HeightMapReader::Read(FloatTexture2DPtr dst, unsigned int dstX, unsigned int dstY,
+                                   unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+                                   float scale, float offset){
+            dst->Load();
+            unsigned int dstWidth = dst->GetWidth();
+            if (dst->GetChannels() != 1 || dstX + w > dstWidth || dstY + h > dst->GetHeight())
+                throw ResourceException("Heightmap tile doesn't fit in the texture");
+
+            float* data = dst->GetData();
+            for (unsigned int j = 0; j < h; ++j)
+                ReadRow(y + j, x, w, data + dstX + (dstY + j) * dstWidth, scale, offset);
+        }
+
+    }
+}
@@ -0,0 +1,111 @@
+// Heightmap file reader.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHTMAP_READER_H_
+#define _HEIGHTMAP_READER_H_
+
+#include <Resources/Texture2D.h>
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * Reads 8 and 16 bit heightmaps from RAW or binary PGM (P5)
+         * files.
+         *
+         * Rows are decoded one at a time directly from the file into
+         * float heights, so neither the file nor an intermediate
+         * integer texture is ever held in memory. Any sub-rectangle
+         * can be read, which allows cutting large maps into tiles.
+         */
+        class HeightMapReader {
+        public:
+            enum ByteOrder { LITTLE_ENDIAN_ORDER, BIG_ENDIAN_ORDER };
+
+        private:
+            std::string filename;
+            FILE* file;
+            unsigned int width, height;
+            unsigned int bytesPerSample;
+            unsigned int maxValue;
+            ByteOrder byteOrder;
+            long long dataOffset;
+            std::vector<unsigned char> row;
+
+        public:
+            /**
+             * Opens a binary PGM file. 16 bit PGM samples are big
+             * endian.
+             *
+             * @throws ResourceException if the file can't be opened or
+             * isn't a binary PGM.
+             */
+            HeightMapReader(const std::string file);
+            /**
+             * Opens a headerless RAW file of width * height samples.
+             *
+             * @param bytesPerSample 1 or 2.
+             * @throws ResourceException if the file can't be opened or
+             * is too small.
+             */
+            HeightMapReader(const std::string file, unsigned int width, unsigned int height,
+                            unsigned int bytesPerSample = 2,
+                            ByteOrder order = LITTLE_ENDIAN_ORDER);
+            ~HeightMapReader();
+
+            unsigned int GetWidth() const { return width; }
+            unsigned int GetHeight() const { return height; }
+            unsigned int GetBytesPerSample() const { return bytesPerSample; }
+            /**
+             * The largest sample value, 255 or 65535 for RAW files and
+             * the maxval of PGM files.
+             */
+            unsigned int GetMaxValue() const { return maxValue; }
+
+            /**
+             * Reads count heights of the given row starting at column
+             * x, dst[i] = sample * scale + offset.
+             */
+            void ReadRow(unsigned int y, unsigned int x, unsigned int count,
+                         float* dst, float scale = 1.0f, float offset = 0.0f);
+
+            /**
+             * Reads the entire heightmap.
+             */
+            FloatTexture2DPtr Read(float scale = 1.0f, float offset = 0.0f);
+            /**
+             * Reads the w * h rectangle starting at (x, y) into a new
+             * texture.
+             */
+            FloatTexture2DPtr Read(unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+                                   float scale = 1.0f, float offset = 0.0f);
+            /**
+             * Reads the w * h rectangle starting at (x, y) into the
+             * single channel texture dst at (dstX, dstY), fx a tile of
+             * a padded heightmap.
+             */
+            void Read(FloatTexture2DPtr dst, unsigned int dstX, unsigned int dstY,
+                      unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+                      float scale = 1.0f, float offset = 0.0f);
+
+        private:
+            void Open();
+            void Seek(long long position);
+        };
+
+    }
+}
+
+#endif
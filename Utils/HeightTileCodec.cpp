@@ -0,0 +1,280 @@
+// Height tile codec.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include <Utils/HeightTileCodec.h>
+
+#include <Logging/Logger.h>
+
+#include <cmath>
+#include <cstring>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        static const unsigned char TILE_MAGIC[4] = {'O', 'E', 'H', 'T'};
+        static const unsigned short TILE_VERSION = 1;
+        static const unsigned int TILE_HEADER_SIZE = 24;
+        static const unsigned int BLOCK_SIZE = 16;
+        // Zero bytes appended to the stream, so the decoder can
+        // always read 8 bytes at a time.
+        static const unsigned int TILE_PADDING = 8;
+        // The most samples a zero run, 2 bytes, can cover.
+        static const unsigned int MAX_RUN_SAMPLES = 256 * BLOCK_SIZE;
+        // Keep the quantized heights well inside 32 bits, so the
+        // prediction can't overflow.
+        static const double MAX_QUANTIZED = 1 << 30;
+
+        static void Write32(unsigned char* p, unsigned int v){
+            p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+        }
+        static unsigned int Read32(const unsigned char* p){
+            return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+        }
+        static void WriteFloat(unsigned char* p, float f){
+            unsigned int v;
+            memcpy(&v, &f, 4);
+            Write32(p, v);
+        }
+        static float ReadFloat(const unsigned char* p){
+            unsigned int v = Read32(p);
+            float f;
+            memcpy(&f, &v, 4);
+            return f;
+        }
+
+        static unsigned int BitWidth(unsigned int v){
+            unsigned int bits = 0;
+            while (v){
+                ++bits;
+                v >>= 1;
+            }
+            return bits;
+        }
+
+        /**
+         * Appends count values of the given bit width to out, least
+         * significant bit first.
+         */
+        static void PackBits(const unsigned int* values, unsigned int count,
+                             unsigned int bits, std::vector<unsigned char>& out){
+            unsigned long long acc = 0;
+            unsigned int filled = 0;
+            for (unsigned int i = 0; i < count; ++i){
+                acc |= (unsigned long long)values[i] << filled;
+                filled += bits;
+                while (filled >= 8){
+                    out.push_back(acc & 0xFF);
+                    acc >>= 8;
+                    filled -= 8;
+                }
+            }
+            if (filled > 0)
+                out.push_back(acc & 0xFF);
+        }
+
+        void EncodeHeightTile(const float* heights, unsigned int width, unsigned int height,
+                              float maxError, std::vector<unsigned char>& out){
+            unsigned int count = width * height;
+            float minHeight = 0.0f, maxHeight = 0.0f;
+            if (count > 0){
+                minHeight = maxHeight = heights[0];
+                for (unsigned int i = 1; i < count; ++i){
+                    minHeight = heights[i] < minHeight ? heights[i] : minHeight;
+                    maxHeight = heights[i] > maxHeight ? heights[i] : maxHeight;
+                }
+            }
+
+            float step = 2.0f * maxError;
+            if (!(step > 0.0f) || (maxHeight - minHeight) / step >= MAX_QUANTIZED){
+                float coarsest = float((maxHeight - minHeight) / (MAX_QUANTIZED - 1));
+                if (coarsest > step){
+                    logger.warning << "Height tile error " << maxError << " is too small for the height range, using " << coarsest / 2 << logger.end;
+                    step = coarsest;
+                }
+                if (!(step > 0.0f)) step = 1.0f; // flat tile
+            }
+            float invStep = 1.0f / step;
+
+            out.clear();
+            out.resize(TILE_HEADER_SIZE);
+            memcpy(&out[0], TILE_MAGIC, 4);
+            out[4] = TILE_VERSION & 0xFF;
+            out[5] = TILE_VERSION >> 8;
+            out[6] = out[7] = 0;
+            Write32(&out[8], width);
+            Write32(&out[12], height);
+            WriteFloat(&out[16], minHeight);
+            WriteFloat(&out[20], step);
+
+            std::vector<int> lower(width), current(width);
+            std::vector<unsigned int> residuals(width);
+            for (unsigned int z = 0; z < height; ++z){
+                // Quantize and predict the row.
+                const float* row = heights + z * width;
+                for (unsigned int x = 0; x < width; ++x){
+                    current[x] = int(floor((row[x] - minHeight) * invStep + 0.5f));
+                    int prediction;
+                    if (z == 0) prediction = x > 0 ? current[x-1] : 0;
+                    else if (x == 0) prediction = lower[0];
+                    else prediction = current[x-1] + lower[x] - lower[x-1];
+                    int r = current[x] - prediction;
+                    residuals[x] = ((unsigned int)r << 1) ^ (unsigned int)(r >> 31);
+                }
+
+                // Pack the residuals in blocks.
+                unsigned int x = 0;
+                while (x < width){
+                    unsigned int n = width - x < BLOCK_SIZE ? width - x : BLOCK_SIZE;
+                    unsigned int largest = 0;
+                    for (unsigned int i = 0; i < n; ++i)
+                        largest |= residuals[x + i];
+                    unsigned int bits = BitWidth(largest);
+                    out.push_back(bits);
+
+                    if (bits == 0){
+                        // Count the following zero blocks.
+                        unsigned int run = 0;
+                        x += n;
+                        while (run < 255 && x < width){
+                            unsigned int m = width - x < BLOCK_SIZE ? width - x : BLOCK_SIZE;
+                            unsigned int any = 0;
+                            for (unsigned int i = 0; i < m; ++i)
+                                any |= residuals[x + i];
+                            if (any) break;
+                            ++run;
+                            x += m;
+                        }
+                        out.push_back(run);
+                    }else{
+                        PackBits(&residuals[x], n, bits, out);
+                        x += n;
+                    }
+                }
+
+                std::swap(lower, current);
+            }
+
+            out.resize(out.size() + TILE_PADDING, 0);
+        }
+
+        std::vector<unsigned char> EncodeHeightTile(FloatTexture2DPtr tex, float maxError){
+            tex->Load();
+            unsigned int width = tex->GetWidth();
+            unsigned int height = tex->GetHeight();
+            unsigned int channels = tex->GetChannels();
+
+            std::vector<unsigned char> out;
+            if (channels == 1)
+                EncodeHeightTile(tex->GetData(), width, height, maxError, out);
+            else{
+                std::vector<float> heights(width * height);
+                const float* data = tex->GetData();
+                for (unsigned int i = 0; i < width * height; ++i)
+                    heights[i] = data[i * channels];
+                EncodeHeightTile(&heights[0], width, height, maxError, out);
+            }
+            return out;
+        }
+
+        bool GetHeightTileInfo(const unsigned char* data, size_t size,
+                               unsigned int& width, unsigned int& height, float& maxError){
+            if (size < TILE_HEADER_SIZE + TILE_PADDING || memcmp(data, TILE_MAGIC, 4) != 0 ||
+                (data[4] | (data[5] << 8)) != TILE_VERSION)
+                return false;
+            width = Read32(data + 8);
+            height = Read32(data + 12);
+            maxError = ReadFloat(data + 20) / 2.0f;
+
+            // Every row takes at least one 2 byte zero run per
+            // MAX_RUN_SAMPLES samples, so a corrupt header can't
+            // claim more samples than the data could hold.
+            unsigned long long runs = (width + (unsigned long long)MAX_RUN_SAMPLES - 1) / MAX_RUN_SAMPLES;
+            if (runs * 2 * height > size - TILE_HEADER_SIZE - TILE_PADDING)
+                return false;
+            return true;
+        }
+
+        bool DecodeHeightTile(const unsigned char* data, size_t size, float* heights){
+            unsigned int width, height;
+            float maxError;
+            if (!GetHeightTileInfo(data, size, width, height, maxError))
+                return false;
+            const float minHeight = ReadFloat(data + 16);
+            const float step = ReadFloat(data + 20);
+
+            const unsigned char* p = data + TILE_HEADER_SIZE;
+            // The last byte any block may end at, leaving the padding
+            // for the 8 byte reads.
+            const unsigned char* end = data + size - TILE_PADDING;
+
+            // With s[x] = q[x] - lower[x] the prediction becomes
+            // s[x] = s[x-1] + r[x], so each row is a running sum of
+            // its residuals added to the row below. The first row is
+            // predicted from a row of zeros.
+            std::vector<int> quantized(width, 0);
+            int* q = width > 0 ? &quantized[0] : NULL;
+            for (unsigned int z = 0; z < height; ++z){
+                float* row = heights + z * width;
+                int sum = 0;
+                unsigned int x = 0;
+                while (x < width){
+                    if (p + 2 > end) return false;
+                    unsigned int bits = *p++;
+                    if (bits == 0){
+                        unsigned int n = (*p++ + 1) * BLOCK_SIZE;
+                        if (n > width - x) n = width - x;
+                        for (unsigned int i = x; i < x + n; ++i){
+                            q[i] += sum;
+                            row[i] = minHeight + q[i] * step;
+                        }
+                        x += n;
+                        continue;
+                    }
+                    if (bits > 32) return false;
+
+                    unsigned int n = width - x < BLOCK_SIZE ? width - x : BLOCK_SIZE;
+                    unsigned int bytes = (n * bits + 7) / 8;
+                    if (p + bytes > end) return false;
+
+                    // Unpack the zigzag coded residuals, reading 8
+                    // bytes at a time into the padding.
+                    const unsigned long long mask = (1ULL << bits) - 1;
+                    unsigned int bit = 0;
+                    for (unsigned int i = x; i < x + n; ++i, bit += bits){
+                        unsigned long long word;
+                        memcpy(&word, p + (bit >> 3), 8);
+                        unsigned int u = (unsigned int)((word >> (bit & 7)) & mask);
+                        sum += int(u >> 1) ^ -int(u & 1);
+                        q[i] += sum;
+                        row[i] = minHeight + q[i] * step;
+                    }
+                    p += bytes;
+                    x += n;
+                }
+            }
+
+            return true;
+        }
+
+        FloatTexture2DPtr DecodeHeightTile(const std::vector<unsigned char>& data){
+            unsigned int width, height;
+            float maxError;
+            if (data.empty() || !GetHeightTileInfo(&data[0], data.size(), width, height, maxError))
+                return FloatTexture2DPtr();
+
+            FloatTexture2DPtr ret = FloatTexture2DPtr(new FloatTexture2D(width, height, LUMINANCE32F));
+            ret->SetWrapping(CLAMP_TO_EDGE);
+            ret->Load();
+            if (!DecodeHeightTile(&data[0], data.size(), ret->GetData()))
+                return FloatTexture2DPtr();
+            return ret;
+        }
+
+    }
+}
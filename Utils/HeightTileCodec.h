@@ -0,0 +1,69 @@
+// Height tile codec.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _HEIGHT_TILE_CODEC_H_
+#define _HEIGHT_TILE_CODEC_H_
+
+#include <Resources/Texture2D.h>
+
+#include <vector>
+#include <cstddef>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * Lossy compression of height tiles.
+         *
+         * The heights are quantized in steps of 2 * maxError, so
+         * every decoded height is within maxError of the original
+         * (plus float rounding of the reconstruction). Each quantized
+         * height is predicted from its left, lower and lower left
+         * neighbours. The zigzag coded residuals are bit packed in
+         * blocks of 16, using the width of the largest residual, and
+         * runs of zero blocks are run length coded.
+         *
+         * The encoded tile is a 24 byte little endian header followed
+         * by the rows of blocks.
+         */
+        void EncodeHeightTile(const float* heights, unsigned int width, unsigned int height,
+                              float maxError, std::vector<unsigned char>& out);
+        /**
+         * Encodes the first channel of a texture.
+         */
+        std::vector<unsigned char> EncodeHeightTile(FloatTexture2DPtr tex, float maxError);
+
+        /**
+         * Reads the header of an encoded tile.
+         *
+         * @return False if the data isn't an encoded tile or is too
+         * small for the dimensions in the header.
+         */
+        bool GetHeightTileInfo(const unsigned char* data, size_t size,
+                               unsigned int& width, unsigned int& height, float& maxError);
+        /**
+         * Decodes a tile into width * height heights.
+         *
+         * @return False if the data is truncated or corrupt.
+         */
+        bool DecodeHeightTile(const unsigned char* data, size_t size, float* heights);
+        /**
+         * Decodes a tile into a new single channel texture.
+         *
+         * @return The texture or an empty pointer if the data is
+         * corrupt.
+         */
+        FloatTexture2DPtr DecodeHeightTile(const std::vector<unsigned char>& data);
+
+    }
+}
+
+#endif
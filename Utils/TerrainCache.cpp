@@ -0,0 +1,174 @@
+// Terrain cache file.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include <Utils/TerrainCache.h>
+
+#include <Logging/Logger.h>
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace OpenEngine {
+    namespace Utils {
+
+        static const char CACHE_MAGIC[8] = {'O', 'E', 'T', 'C', 'A', 'C', 'H', 'E'};
+        static const unsigned long long SECTION_ALIGNMENT = 16;
+
+        TerrainCache::TerrainCache()
+            : map(NULL), mapSize(0) {
+#ifdef _WIN32
+            file = mapping = NULL;
+#endif
+        }
+
+        TerrainCache::~TerrainCache(){
+            Close();
+        }
+
+        bool TerrainCache::Open(const std::string& filename){
+            Close();
+
+#ifdef _WIN32
+            file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE){
+                file = NULL;
+                return false;
+            }
+            LARGE_INTEGER size;
+            GetFileSizeEx(file, &size);
+            mapSize = (size_t)size.QuadPart;
+            if (mapSize >= sizeof(Header)){
+                mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+                if (mapping != NULL)
+                    map = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            }
+#else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)){
+                mapSize = st.st_size;
+                void* m = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (m != MAP_FAILED) map = m;
+            }
+            // The mapping stays valid after the file is closed.
+            close(fd);
+#endif
+            if (map == NULL){
+                Close();
+                return false;
+            }
+
+            // Validate the header and the section bounds.
+            const Header& header = GetHeader();
+            bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+                header.version == VERSION;
+            for (int s = 0; valid && s < SECTIONS; ++s)
+                valid = header.offsets[s] <= mapSize &&
+                    header.sizes[s] <= mapSize - header.offsets[s];
+            if (!valid){
+                logger.warning << "Invalid or outdated terrain cache: " << filename << logger.end;
+                Close();
+                return false;
+            }
+
+            return true;
+        }
+
+        void TerrainCache::Close(){
+#ifdef _WIN32
+            if (map != NULL) UnmapViewOfFile(map);
+            if (mapping != NULL) CloseHandle(mapping);
+            if (file != NULL) CloseHandle(file);
+            file = mapping = NULL;
+#else
+            if (map != NULL) munmap(map, mapSize);
+#endif
+            map = NULL;
+            mapSize = 0;
+        }
+
+        const void* TerrainCache::GetSection(Section s) const{
+            return (const char*)map + GetHeader().offsets[s];
+        }
+
+        bool TerrainCache::Write(const std::string& filename, Header header,
+                                 const void* const sections[SECTIONS]){
+            memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+            header.version = VERSION;
+
+            unsigned long long offset = sizeof(Header);
+            for (int s = 0; s < SECTIONS; ++s){
+                offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+                header.offsets[s] = offset;
+                offset += header.sizes[s];
+            }
+
+            // Write to a temporary file and move it in place, so an
+            // interrupted write never leaves a broken cache behind.
+            std::string temp = filename + ".tmp";
+            FILE* out = fopen(temp.c_str(), "wb");
+            if (out == NULL){
+                logger.warning << "Could not write terrain cache: " << filename << logger.end;
+                return false;
+            }
+
+            bool ok = fwrite(&header, sizeof(Header), 1, out) == 1;
+            unsigned long long written = sizeof(Header);
+            const char padding[SECTION_ALIGNMENT] = {0};
+            for (int s = 0; ok && s < SECTIONS; ++s){
+                if (header.offsets[s] > written)
+                    ok = fwrite(padding, header.offsets[s] - written, 1, out) == 1;
+                if (ok && header.sizes[s] > 0)
+                    ok = fwrite(sections[s], header.sizes[s], 1, out) == 1;
+                written = header.offsets[s] + header.sizes[s];
+            }
+            ok = (fclose(out) == 0) && ok;
+
+            if (ok){
+                remove(filename.c_str());
+                ok = rename(temp.c_str(), filename.c_str()) == 0;
+            }
+            if (!ok){
+                remove(temp.c_str());
+                logger.warning << "Could not write terrain cache: " << filename << logger.end;
+            }
+            return ok;
+        }
+
+        unsigned long long TerrainCache::Hash(const void* data, size_t bytes,
+                                              unsigned long long hash){
+            // FNV-1a over 64 bit words with a final pass over the
+            // remaining bytes.
+            const unsigned long long PRIME = 1099511628211ULL;
+            const unsigned char* p = (const unsigned char*)data;
+            size_t words = bytes / 8;
+            for (size_t i = 0; i < words; ++i){
+                unsigned long long w;
+                memcpy(&w, p + i * 8, 8);
+                hash = (hash ^ w) * PRIME;
+                hash ^= hash >> 29;
+            }
+            for (size_t i = words * 8; i < bytes; ++i)
+                hash = (hash ^ p[i]) * PRIME;
+            return hash;
+        }
+
+    }
+}
@@ -0,0 +1,95 @@
+// Terrain cache file.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TERRAIN_CACHE_H_
+#define _TERRAIN_CACHE_H_
+
+#include <string>
+#include <cstddef>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A binary file holding the precomputed data of a heightmap,
+         * so it can be loaded without being recomputed.
+         *
+         * The file is a header followed by the data sections, each
+         * aligned to 16 bytes. An opened cache is memory mapped copy
+         * on write, so pages are only read from disk when a section
+         * is accessed.
+         */
+        class TerrainCache {
+        public:
+            static const unsigned int VERSION = 5;
+
+            enum Section { HEIGHTS = 0, VERTICES, NORMALS, NORMALMAP_COORDS,
+                           GEOMORPH, DELTAS, PATCH_BOUNDS, PATCH_ERRORS, PATCH_OCCLUDERS, PATCH_LODS, INDICES,
+                           SECTIONS };
+
+            struct Header {
+                char magic[8];
+                unsigned int version;
+                unsigned int flags;
+                unsigned long long hash;
+                int width, depth;
+                int patchGridWidth, patchGridDepth;
+                unsigned long long offsets[SECTIONS];
+                unsigned long long sizes[SECTIONS];
+            };
+
+        private:
+            void* map;
+            size_t mapSize;
+#ifdef _WIN32
+            void* file;
+            void* mapping;
+#endif
+
+        public:
+            TerrainCache();
+            ~TerrainCache();
+
+            /**
+             * Maps the cache file into memory.
+             *
+             * @return False if the file could not be mapped or isn't
+             * a valid cache of the current version.
+             */
+            bool Open(const std::string& file);
+            void Close();
+            bool IsOpen() const { return map != NULL; }
+
+            const Header& GetHeader() const { return *(const Header*)map; }
+            const void* GetSection(Section s) const;
+            unsigned long long GetSectionSize(Section s) const { return GetHeader().sizes[s]; }
+
+            /**
+             * Writes a cache file. The magic, version and section
+             * offsets of the header are filled in, the rest is
+             * written as given.
+             *
+             * @return True if the file was written.
+             */
+            static bool Write(const std::string& file, Header header,
+                              const void* const sections[SECTIONS]);
+
+            /**
+             * 64 bit hash of the given data, used to validate that a
+             * cache belongs to its source. Chain hashes by passing
+             * the previous hash as seed.
+             */
+            static unsigned long long Hash(const void* data, size_t bytes,
+                                           unsigned long long seed = 14695981039346656037ULL);
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,77 @@
+// Terrain Texture Filters.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#include <Utils/TerrainTexFilters.h>
+
+#include <cmath>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        ConvolutionKernel::ConvolutionKernel()
+            : weights(1, 1.0f) {}
+
+        ConvolutionKernel::ConvolutionKernel(const std::vector<float>& w)
+            : weights(w) {
+            if (weights.empty())
+                weights.push_back(1.0f);
+            else if (weights.size() % 2 == 0)
+                weights.push_back(0.0f);
+        }
+
+        void ConvolutionKernel::Normalize(){
+            float sum = 0.0f;
+            for (unsigned int i = 0; i < weights.size(); ++i)
+                sum += weights[i];
+            if (sum != 0.0f)
+                for (unsigned int i = 0; i < weights.size(); ++i)
+                    weights[i] /= sum;
+        }
+
+        ConvolutionKernel ConvolutionKernel::Identity(){
+            return ConvolutionKernel();
+        }
+
+        ConvolutionKernel ConvolutionKernel::Box(int halfsize){
+            if (halfsize < 0) halfsize = 0;
+            std::vector<float> w(2 * halfsize + 1, 1.0f / (2 * halfsize + 1));
+            return ConvolutionKernel(w);
+        }
+
+        ConvolutionKernel ConvolutionKernel::Gaussian(float sigma, int radius){
+            if (sigma <= 0.0f) return Identity();
+            if (radius < 0) radius = (int)ceil(3.0f * sigma);
+
+            std::vector<float> w(2 * radius + 1);
+            float invTwoSigmaSqr = 1.0f / (2.0f * sigma * sigma);
+            for (int i = -radius; i <= radius; ++i)
+                w[i + radius] = exp(-i * i * invTwoSigmaSqr);
+
+            ConvolutionKernel kernel(w);
+            kernel.Normalize();
+            return kernel;
+        }
+
+        ConvolutionKernel ConvolutionKernel::Sharpen(float amount){
+            std::vector<float> w(3);
+            w[0] = w[2] = -amount / 2.0f;
+            w[1] = 1.0f + amount;
+            return ConvolutionKernel(w);
+        }
+
+        ConvolutionKernel ConvolutionKernel::Derivative(){
+            std::vector<float> w(3);
+            w[0] = -0.5f;
+            w[1] = 0.0f;
+            w[2] = 0.5f;
+            return ConvolutionKernel(w);
+        }
+
+    }
+}
@@ -0,0 +1,215 @@
+// Terrain Texture Filters.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TERRAIN_TEXTURE_FILTERS_H_
+#define _TERRAIN_TEXTURE_FILTERS_H_
+
+#include <Utils/TerrainTexUtils.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <cstring>
+
+using namespace OpenEngine::Resources;
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A one dimensional convolution kernel. The kernel has an odd
+         * number of weights and is centered on the middle one.
+         */
+        class ConvolutionKernel {
+        protected:
+            std::vector<float> weights;
+
+        public:
+            ConvolutionKernel();
+            /**
+             * Creates a kernel from the given weights. An even number
+             * of weights is padded with a zero weight at the end.
+             */
+            ConvolutionKernel(const std::vector<float>& weights);
+
+            int GetRadius() const { return weights.size() / 2; }
+            unsigned int GetSize() const { return weights.size(); }
+            const float* GetWeights() const { return &weights[0]; }
+            /**
+             * The weight at offset i from the center, where -radius
+             * <= i <= radius.
+             */
+            float operator[](const int i) const { return weights[i + GetRadius()]; }
+
+            /**
+             * Scales the weights so they sum to one.
+             */
+            void Normalize();
+
+            static ConvolutionKernel Identity();
+            static ConvolutionKernel Box(int halfsize);
+            /**
+             * A normalized gaussian. If no radius is given it is
+             * chosen as ceil(3 * sigma).
+             */
+            static ConvolutionKernel Gaussian(float sigma, int radius = -1);
+            /**
+             * Unsharp masking, amplifies the difference to the
+             * neighbours by amount.
+             */
+            static ConvolutionKernel Sharpen(float amount = 1.0f);
+            /**
+             * Central difference, approximates the derivative along
+             * the filtered direction.
+             */
+            static ConvolutionKernel Derivative();
+        };
+
+        /**
+         * Adds weight * in to out for count elements.
+         */
+        inline void ConvolutionAxpy(float* out, const float* in, const float weight, const int count){
+            int i = 0;
+#ifdef __SSE2__
+            __m128 w = _mm_set1_ps(weight);
+            for (; i + 4 <= count; i += 4){
+                __m128 o = _mm_loadu_ps(out + i);
+                o = _mm_add_ps(o, _mm_mul_ps(w, _mm_loadu_ps(in + i)));
+                _mm_storeu_ps(out + i, o);
+            }
+#endif
+            for (; i < count; ++i)
+                out[i] += weight * in[i];
+        }
+
+        /**
+         * Converts a filtered value back to the texture type, rounding
+         * and clamping integer types to their range.
+         */
+        template <class T>
+        inline T ConvolutionCast(const float v){
+            if (std::numeric_limits<T>::is_integer){
+                if (v <= float(std::numeric_limits<T>::min())) return std::numeric_limits<T>::min();
+                if (v >= float(std::numeric_limits<T>::max())) return std::numeric_limits<T>::max();
+                return T(v < 0.0f ? v - 0.5f : v + 0.5f);
+            }
+            return T(v);
+        }
+
+        /**
+         * Separable convolution. Applies the horizontal kernel along
+         * the width of the texture and the vertical along its
+         * height. Texels outside the texture are sampled according to
+         * its wrapping, like GetPixel.
+         *
+         * The texture is processed in tiles, each filtered
+         * horizontally into a small float buffer and then vertically
+         * into the result, so the intermediate values stay in the
+         * cache. Tiles are processed in parallel.
+         */
+        template <class T>
+        void Convolve(Texture2DPtr(T) tex,
+                      const ConvolutionKernel& horizontal,
+                      const ConvolutionKernel& vertical){
+            tex->Load();
+
+            const int width = tex->GetWidth();
+            const int height = tex->GetHeight();
+            const int channels = tex->GetChannels();
+            const int rowSize = width * channels;
+            const Wrapping wrapping = tex->GetWrapping();
+
+            const int rh = horizontal.GetRadius();
+            const int rv = vertical.GetRadius();
+
+            // Tiles are made tall enough that the rows filtered twice
+            // because they are shared with the neighbouring tiles
+            // don't dominate.
+            const int TILE_WIDTH = 128;
+            const int tileHeight = 4 * rv > 64 ? 4 * rv : 64;
+            const int tilesX = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+            const int tilesY = (height + tileHeight - 1) / tileHeight;
+
+            // Map the coordinates outside the texture to the texels
+            // sampled.
+            std::vector<int> columns(width + 2 * rh);
+            for (int x = -rh; x < width + rh; ++x)
+                columns[x + rh] = WrapTexel(x, width, wrapping);
+            std::vector<int> rows(height + 2 * rv);
+            for (int y = -rv; y < height + rv; ++y)
+                rows[y + rv] = WrapTexel(y, height, wrapping);
+
+            const T* data = tex->GetData();
+            T* result = new T[rowSize * height];
+
+#pragma omp parallel for schedule(dynamic)
+            for (int t = 0; t < tilesX * tilesY; ++t){
+                const int x0 = (t % tilesX) * TILE_WIDTH;
+                const int y0 = (t / tilesX) * tileHeight;
+                const int x1 = x0 + TILE_WIDTH > width ? width : x0 + TILE_WIDTH;
+                const int y1 = y0 + tileHeight > height ? height : y0 + tileHeight;
+                const int tileRow = (x1 - x0) * channels;
+                const int tileRows = y1 - y0 + 2 * rv;
+
+                std::vector<float> line((x1 - x0 + 2 * rh) * channels);
+                std::vector<float> filtered(tileRow * tileRows, 0.0f);
+                std::vector<float> sum(tileRow);
+
+                // Filter the rows of the tile, including the rows
+                // above and below needed by the vertical kernel.
+                for (int r = 0; r < tileRows; ++r){
+                    const T* src = data + rows[y0 + r] * rowSize;
+                    for (int x = x0 - rh; x < x1 + rh; ++x){
+                        const T* texel = src + columns[x + rh] * channels;
+                        float* dst = &line[(x - x0 + rh) * channels];
+                        for (int c = 0; c < channels; ++c)
+                            dst[c] = float(texel[c]);
+                    }
+                    float* out = &filtered[r * tileRow];
+                    for (int k = -rh; k <= rh; ++k)
+                        ConvolutionAxpy(out, &line[(k + rh) * channels], horizontal[k], tileRow);
+                }
+
+                // Filter the columns into the result.
+                for (int y = y0; y < y1; ++y){
+                    std::fill(sum.begin(), sum.end(), 0.0f);
+                    for (int k = -rv; k <= rv; ++k)
+                        ConvolutionAxpy(&sum[0], &filtered[(y - y0 + rv + k) * tileRow], vertical[k], tileRow);
+                    T* dst = result + y * rowSize + x0 * channels;
+                    for (int i = 0; i < tileRow; ++i)
+                        dst[i] = ConvolutionCast<T>(sum[i]);
+                }
+            }
+
+            memcpy(tex->GetData(), result, sizeof(T) * rowSize * height);
+            delete [] result;
+        }
+
+        /**
+         * Convolves the texture with the same kernel in both
+         * directions.
+         */
+        template <class T>
+        void Convolve(Texture2DPtr(T) tex, const ConvolutionKernel& kernel){
+            Convolve<T>(tex, kernel, kernel);
+        }
+
+        /**
+         * Gaussian smoothing with the given standard deviation in
+         * texels.
+         */
+        template <class T>
+        void GaussianBlur(Texture2DPtr(T) tex, float sigma){
+            Convolve<T>(tex, ConvolutionKernel::Gaussian(sigma));
+        }
+
+    }
+}
+
+#endif
@@ -10,6 +10,10 @@
 #include <Utils/TerrainTexUtils.h>
 #include <Logging/Logger.h>
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 namespace OpenEngine {
     namespace Utils {
 
@@ -24,13 +28,7 @@ namespace OpenEngine {
             ret->Load();
 
             // Fill the data array
-            for (unsigned int x = 0; x < width; ++x){
-                for (unsigned int z = 0; z < height; ++z){
-                    for (unsigned int c = 0; c < channels; ++c){
-                        ret->GetPixel(x, z)[c] = tex->GetPixel(x, z)[c];
-                    }   
-                }
-            }
+            ScaleSamples(tex->GetData(), 1, ret->GetData(), width * height * channels);
 
             // Set other options
             ret->SetColorFormat(tex->GetColorFormat());
@@ -39,60 +37,306 @@ namespace OpenEngine {
 
             return ret;
         }        
+
+        void ScaleSamples(const unsigned char* src, unsigned int stride, float* dst, 
+                          unsigned int count, float scale, float offset){
+            unsigned int i = 0;
+#ifdef __SSE2__
+            if (stride == 1){
+                const __m128i zero = _mm_setzero_si128();
+                const __m128 s = _mm_set1_ps(scale);
+                const __m128 o = _mm_set1_ps(offset);
+                for (; i + 16 <= count; i += 16){
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                    __m128i lo = _mm_unpacklo_epi8(v, zero);
+                    __m128i hi = _mm_unpackhi_epi8(v, zero);
+                    __m128i w[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+                                     _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+                    for (int q = 0; q < 4; ++q)
+                        _mm_storeu_ps(dst + i + q * 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(w[q]), s), o));
+                }
+            }
+#endif
+            for (; i < count; ++i)
+                dst[i] = src[i * stride] * scale + offset;
+        }
+
+        void ScaleSamples(const unsigned short* src, unsigned int stride, float* dst, 
+                          unsigned int count, float scale, float offset){
+            unsigned int i = 0;
+#ifdef __SSE2__
+            if (stride == 1){
+                const __m128i zero = _mm_setzero_si128();
+                const __m128 s = _mm_set1_ps(scale);
+                const __m128 o = _mm_set1_ps(offset);
+                for (; i + 8 <= count; i += 8){
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                    __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+                    __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+                    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(lo, s), o));
+                    _mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_mul_ps(hi, s), o));
+                }
+            }
+#endif
+            for (; i < count; ++i)
+                dst[i] = src[i * stride] * scale + offset;
+        }
+
+        void ScaleSamples(const float* src, unsigned int stride, float* dst, 
+                          unsigned int count, float scale, float offset){
+            unsigned int i = 0;
+#ifdef __SSE2__
+            if (stride == 1){
+                const __m128 s = _mm_set1_ps(scale);
+                const __m128 o = _mm_set1_ps(offset);
+                for (; i + 4 <= count; i += 4)
+                    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), s), o));
+            }
+#endif
+            for (; i < count; ++i)
+                dst[i] = src[i * stride] * scale + offset;
+        }
+
+        template <class T>
+        FloatTexture2DPtr ImportSamples(Texture2DPtr(T) src, unsigned int width, unsigned int height,
+                                        float scale, float offset, bool release){
+            src->Load();
+
+            unsigned int srcWidth = src->GetWidth();
+            unsigned int srcHeight = src->GetHeight();
+            unsigned int channels = src->GetChannels();
+            unsigned int copyWidth = std::min(width, srcWidth);
+
+            FloatTexture2DPtr ret = FloatTexture2DPtr(new FloatTexture2D(width, height, LUMINANCE32F));
+            ret->SetWrapping(CLAMP_TO_EDGE);
+            ret->Load();
+
+            const T* in = src->GetData();
+            float* out = ret->GetData();
+#pragma omp parallel for
+            for (int z = 0; z < int(height); ++z){
+                float* row = out + z * width;
+                unsigned int x = 0;
+                if (z < int(srcHeight)){
+                    // inside the heightmap
+                    ScaleSamples(in + z * srcWidth * channels, channels, row, copyWidth, scale, offset);
+                    x = copyWidth;
+                }
+                // outside the heightmap, set height to waterlevel
+                for (; x < width; ++x)
+                    row[x] = offset;
+            }
+
+            if (release)
+                src->Unload();
+
+            return ret;
+        }
+
+        FloatTexture2DPtr ImportHeightMap(UCharTexture2DPtr src, unsigned int width, unsigned int height,
+                                          float scale, float offset, bool release){
+            return ImportSamples<unsigned char>(src, width, height, scale, offset, release);
+        }
+
+        FloatTexture2DPtr ImportHeightMap(Texture2DPtr(unsigned short) src, unsigned int width, unsigned int height,
+                                          float scale, float offset, bool release){
+            return ImportSamples<unsigned short>(src, width, height, scale, offset, release);
+        }
+
+        FloatTexture2DPtr ImportHeightMap(FloatTexture2DPtr src, unsigned int width, unsigned int height,
+                                          float scale, float offset, bool release){
+            return ImportSamples<float>(src, width, height, scale, offset, release);
+        }
         
+        /**
+         * Packs count pixels of the given number of channels into
+         * unsigned ints, channel c in byte c.
+         */
+        static void PackRow(const unsigned char* src, unsigned int channels, 
+                            unsigned int* dst, unsigned int count){
+            unsigned int i = 0;
+            if (channels >= 4){
+                if (channels == 4){
+                    memcpy(dst, src, count * 4);
+                    return;
+                }
+                for (; i < count; ++i)
+                    dst[i] = src[i * channels] | (src[i * channels + 1] << 8) |
+                        (src[i * channels + 2] << 16) | (src[i * channels + 3] << 24);
+                return;
+            }
+#ifdef __SSSE3__
+            if (channels == 3){
+                // Spread 4 rgb pixels into 4 words, -1 zeroes the byte.
+                const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 
+                                                      6, 7, 8, -1, 9, 10, 11, -1);
+                for (; i + 6 <= count; i += 4){
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, shuffle));
+                }
+            }
+#endif
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            if (channels == 1){
+                for (; i + 16 <= count; i += 16){
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                    __m128i lo = _mm_unpacklo_epi8(v, zero);
+                    __m128i hi = _mm_unpackhi_epi8(v, zero);
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(lo, zero));
+                    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(lo, zero));
+                    _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpacklo_epi16(hi, zero));
+                    _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+                }
+            }else if (channels == 2){
+                for (; i + 8 <= count; i += 8){
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(v, zero));
+                    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(v, zero));
+                }
+            }
+#endif
+            for (; i < count; ++i){
+                unsigned int p = 0;
+                for (unsigned int c = 0; c < channels; ++c)
+                    p |= src[i * channels + c] << (c * 8);
+                dst[i] = p;
+            }
+        }
+
+        /**
+         * Unpacks count unsigned ints into pixels of the given number
+         * of channels, channel c from byte c.
+         */
+        static void UnpackRow(const unsigned int* src, unsigned char* dst, 
+                              unsigned int channels, unsigned int count){
+            unsigned int i = 0;
+            if (channels == 4){
+                memcpy(dst, src, count * 4);
+                return;
+            }
+#ifdef __SSSE3__
+            if (channels == 3){
+                // Gather the rgb bytes of 4 words into 12 bytes.
+                const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 
+                                                      10, 12, 13, 14, -1, -1, -1, -1);
+                for (; i + 6 <= count; i += 4){
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+                    _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(v, shuffle));
+                }
+            }
+#endif
+#ifdef __SSE2__
+            if (channels == 1){
+                const __m128i mask = _mm_set1_epi32(0xFF);
+                for (; i + 16 <= count; i += 16){
+                    __m128i w[4];
+                    for (int q = 0; q < 4; ++q)
+                        w[q] = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i + q * 4)), mask);
+                    __m128i lo = _mm_packs_epi32(w[0], w[1]);
+                    __m128i hi = _mm_packs_epi32(w[2], w[3]);
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+                }
+            }
+#endif
+            for (; i < count; ++i)
+                for (unsigned int c = 0; c < channels; ++c)
+                    dst[i * channels + c] = c < 4 ? (src[i] >> (c * 8)) & 0xFF : 0;
+        }
+
         UIntTexture2DPtr Merge(UCharTexture2DPtr t1,
                                UCharTexture2DPtr t2,
                                UCharTexture2DPtr t3, 
                                UCharTexture2DPtr t4){
+            UCharTexture2DPtr texs[4];
+            unsigned int elements = 0;
+            if (t1 != NULL) texs[elements++] = t1;
+            if (t2 != NULL) texs[elements++] = t2;
+            if (t3 != NULL) texs[elements++] = t3;
+            if (t4 != NULL) texs[elements++] = t4;
+            if (elements == 0) return UIntTexture2DPtr();
+
+            for (unsigned int e = 0; e < elements; ++e)
+                texs[e]->Load();
+
             // Check that the dimensions are the same. 
 
             //@TODO could be replaced by some sort of interpolation of
             // the smallest element.
 
-            unsigned int width = t1->GetWidth();
-            unsigned int height = t1->GetHeight();
+            unsigned int width = texs[0]->GetWidth();
+            unsigned int height = texs[0]->GetHeight();
             
 #ifdef OE_SAFE
-            if (width != t2->GetWidth() ||
-                height != t2->GetHeight()){
-                throw Exception("Trying to combine textures of different dimensions. Aborting.");
-            }
+            for (unsigned int e = 1; e < elements; ++e)
+                if (width != texs[e]->GetWidth() ||
+                    height != texs[e]->GetHeight()){
+                    throw Exception("Trying to combine textures of different dimensions. Aborting.");
+                }
 #endif
             
-            UIntTexture2DPtr ret = UIntTexture2DPtr(new UIntTexture2D(width, height, 2));
-
-            for (unsigned int x = 0; x < width; ++x){
-                for (unsigned int y = 0; y < height; ++y){
-                    unsigned char* p1 = t1->GetPixel(x, y);
-                    ret->GetPixel(x, y)[0] = p1[0];
-                    for (int c = 1; c < t1->GetChannels(); ++c)
-                        ret->GetPixel(x, y)[0] += p1[c] << (c*8);
-
-                    if (t2 != NULL){
-                        unsigned char* p1 = t1->GetPixel(x, y);
-                        ret->GetPixel(x, y)[0] = p1[0];
-                        for (int c = 1; c < t1->GetChannels(); ++c)
-                            ret->GetPixel(x, y)[0] += p1[c] << (c*8);
-                    }
-
-                    if (t3 != NULL){
-                        unsigned char* p1 = t1->GetPixel(x, y);
-                        ret->GetPixel(x, y)[0] = p1[0];
-                        for (int c = 1; c < t1->GetChannels(); ++c)
-                            ret->GetPixel(x, y)[0] += p1[c] << (c*8);
-                    }
-                    
-                    if (t4 != NULL){
-                        unsigned char* p1 = t1->GetPixel(x, y);
-                        ret->GetPixel(x, y)[0] = p1[0];
-                        for (int c = 1; c < t1->GetChannels(); ++c)
-                            ret->GetPixel(x, y)[0] += p1[c] << (c*8);
-                    }
+            UIntTexture2DPtr ret = UIntTexture2DPtr(new UIntTexture2D(width, height, elements));
+            // Packed values must not be filtered or compressed.
+            ret->SetMipmapping(false);
+            ret->SetCompression(false);
+            ret->Load();
+
+            unsigned int* out = ret->GetData();
+#pragma omp parallel for
+            for (int y = 0; y < int(height); ++y){
+                unsigned int* row = out + y * width * elements;
+                if (elements == 1){
+                    PackRow(texs[0]->GetData() + y * width * texs[0]->GetChannels(),
+                            texs[0]->GetChannels(), row, width);
+                    continue;
+                }
+
+                std::vector<unsigned int> packed(width);
+                for (unsigned int e = 0; e < elements; ++e){
+                    unsigned int channels = texs[e]->GetChannels();
+                    PackRow(texs[e]->GetData() + y * width * channels, channels, &packed[0], width);
+                    for (unsigned int x = 0; x < width; ++x)
+                        row[x * elements + e] = packed[x];
                 }
             }       
 
             return ret;
         }
 
+        UCharTexture2DPtr Unpack(UIntTexture2DPtr packed, unsigned int element,
+                                 unsigned int channels){
+            packed->Load();
+
+            unsigned int width = packed->GetWidth();
+            unsigned int height = packed->GetHeight();
+            unsigned int elements = packed->GetChannels();
+
+#ifdef OE_SAFE
+            if (element >= elements)
+                throw Exception("Trying to unpack a non-existing element. Aborting.");
+#endif
+
+            UCharTexture2DPtr ret = UCharTexture2DPtr(new UCharTexture2D(width, height, channels));
+            ret->Load();
+
+            unsigned char* out = ret->GetData();
+#pragma omp parallel for
+            for (int y = 0; y < int(height); ++y){
+                const unsigned int* row = packed->GetData() + y * width * elements;
+                unsigned char* dst = out + y * width * channels;
+                if (elements == 1){
+                    UnpackRow(row, dst, channels, width);
+                    continue;
+                }
+
+                std::vector<unsigned int> words(width);
+                for (unsigned int x = 0; x < width; ++x)
+                    words[x] = row[x * elements + element];
+                UnpackRow(&words[0], dst, channels, width);
+            }
+
+            return ret;
+        }
+
     }
 }
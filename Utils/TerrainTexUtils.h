@@ -12,59 +12,273 @@
 
 #include <Resources/Texture2D.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 using namespace OpenEngine::Resources;
 
 namespace OpenEngine {
     namespace Utils {
         FloatTexture2DPtr ConvertTex(UCharTexture2DPtr tex);
 
-        
+        /**
+         * Converts count samples into heights, dst[i] = src[i *
+         * stride] * scale + offset. Uses SSE2 when the samples are
+         * tightly packed.
+         */
+        void ScaleSamples(const unsigned char* src, unsigned int stride, float* dst, 
+                          unsigned int count, float scale = 1.0f, float offset = 0.0f);
+        void ScaleSamples(const unsigned short* src, unsigned int stride, float* dst, 
+                          unsigned int count, float scale = 1.0f, float offset = 0.0f);
+        void ScaleSamples(const float* src, unsigned int stride, float* dst, 
+                          unsigned int count, float scale = 1.0f, float offset = 0.0f);
 
+        /**
+         * Imports the first channel of a heightmap into a new
+         * luminance float texture of the given dimensions in a single
+         * pass, applying the scale and offset. Texels outside the
+         * source are set to offset.
+         *
+         * If release is true the source texture is unloaded
+         * afterwards.
+         */
+        FloatTexture2DPtr ImportHeightMap(UCharTexture2DPtr src, unsigned int width, unsigned int height,
+                                          float scale = 1.0f, float offset = 0.0f, bool release = true);
+        FloatTexture2DPtr ImportHeightMap(Texture2DPtr(unsigned short) src, unsigned int width, unsigned int height,
+                                          float scale = 1.0f, float offset = 0.0f, bool release = true);
+        FloatTexture2DPtr ImportHeightMap(FloatTexture2DPtr src, unsigned int width, unsigned int height,
+                                          float scale = 1.0f, float offset = 0.0f, bool release = false);
+
+        /**
+         * Packs up to four textures of the same dimensions into an
+         * unsigned int texture with an element pr. given texture. The
+         * channels of each texture are packed into the bytes of its
+         * element, channel c in bits 8c to 8c+7. Only the first four
+         * channels are used.
+         */
         UIntTexture2DPtr Merge(UCharTexture2DPtr t1, 
                                UCharTexture2DPtr t2 = UCharTexture2DPtr(), 
                                UCharTexture2DPtr t3 = UCharTexture2DPtr(), 
                                UCharTexture2DPtr t4 = UCharTexture2DPtr());
 
         /**
-         * Box bluring. Runs in time O(texSize^2 * 2halfsize). While
-         * linear time is possible for box bluring, specialized
-         * functions would be needed to handle overflow.
+         * The inverse of Merge. Unpacks the given element of a packed
+         * texture into a texture with the given number of channels.
+         */
+        UCharTexture2DPtr Unpack(UIntTexture2DPtr packed, unsigned int element = 0,
+                                 unsigned int channels = 4);
+
+        /**
+         * Returns the texel coordinate sampled when accessing coord
+         * in a texture dimension of the given size, following the
+         * wrapping of the texture the same way as GetPixel.
+         */
+        inline int WrapTexel(int coord, int size, Wrapping wrapping){
+            if (wrapping == REPEAT){
+                coord %= size;
+                return coord < 0 ? coord + size : coord;
+            }
+            return coord < 0 ? 0 : (coord >= size ? size - 1 : coord);
+        }
+
+        /**
+         * The type used to sum up texel values of type T, wide enough
+         * to hold the sum of a blur window without overflowing, and
+         * how to average it back into a T.
+         */
+        template <class T> struct BlurAccumulator {
+            typedef T Type;
+            static T Average(Type sum, int window) { return T(sum / window); }
+        };
+        template <> struct BlurAccumulator<float> {
+            typedef double Type;
+            static float Average(Type sum, int window) { return float(sum / window); }
+        };
+        template <> struct BlurAccumulator<unsigned char> {
+            typedef unsigned int Type;
+            static unsigned char Average(Type sum, int window) { 
+                // Same rounding as the SSE path in BlurColumns.
+                return (unsigned char)(float(sum) * (1.0f / window) + 0.5f); 
+            }
+        };
+        template <> struct BlurAccumulator<char> {
+            typedef int Type;
+            static char Average(Type sum, int window) { 
+                return char((sum < 0 ? sum - window / 2 : sum + window / 2) / window); 
+            }
+        };
+        template <> struct BlurAccumulator<unsigned short> {
+            typedef unsigned int Type;
+            static unsigned short Average(Type sum, int window) { return (sum + window / 2) / window; }
+        };
+        template <> struct BlurAccumulator<short> {
+            typedef int Type;
+            static short Average(Type sum, int window) { 
+                return short((sum < 0 ? sum - window / 2 : sum + window / 2) / window); 
+            }
+        };
+        template <> struct BlurAccumulator<unsigned int> {
+            typedef unsigned long long Type;
+            static unsigned int Average(Type sum, int window) { return (sum + window / 2) / window; }
+        };
+        template <> struct BlurAccumulator<int> {
+            typedef long long Type;
+            static int Average(Type sum, int window) { 
+                return int((sum < 0 ? sum - window / 2 : sum + window / 2) / window); 
+            }
+        };
+
+        /**
+         * Slides the vertical blur window one row down for count
+         * texel components. Adds the row entering the window, removes
+         * the row leaving it and writes the averages to out.
          */
         template <class T>
-        void BoxBlur(Texture2DPtr(T) tex, int halfsize = 1){
-            unsigned int width = tex->GetWidth();
-            unsigned int height = tex->GetHeight();
-            unsigned char channels = tex->GetChannels();
-
-            Texture2D<T> temp = Texture2D<T>(width, height, channels);
-            temp.Load();
-            temp.SetWrapping(tex->GetWrapping());
-
-            for (unsigned int x = 0; x < width; ++x){
-                for (unsigned int y = 0; y < height; ++y){
-                    T* pixel = temp.GetPixel(x, y);
-                    for (unsigned char c = 0; c < channels; ++c){
-                        pixel[c] = 0;
-                        for (int X = -halfsize; X <= halfsize; ++X){
-                            pixel[c] += tex->GetPixel(x + X, y)[c];
-                        }
-                        pixel[c] /= (halfsize * 2 + 1);
+        inline void BlurColumns(const T* enter, const T* leave, 
+                                typename BlurAccumulator<T>::Type* acc,
+                                T* out, int count, int window){
+            for (int i = 0; i < count; ++i){
+                acc[i] += enter[i];
+                acc[i] -= leave[i];
+                out[i] = BlurAccumulator<T>::Average(acc[i], window);
+            }
+        }
+
+#ifdef __SSE2__
+        inline void BlurColumns(const float* enter, const float* leave, double* acc,
+                                float* out, int count, int window){
+            __m128d inv = _mm_set1_pd(1.0 / window);
+            int i = 0;
+            for (; i + 4 <= count; i += 4){
+                __m128 e = _mm_loadu_ps(enter + i);
+                __m128 l = _mm_loadu_ps(leave + i);
+                __m128d lo = _mm_loadu_pd(acc + i);
+                __m128d hi = _mm_loadu_pd(acc + i + 2);
+                lo = _mm_sub_pd(_mm_add_pd(lo, _mm_cvtps_pd(e)), _mm_cvtps_pd(l));
+                hi = _mm_sub_pd(_mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(e, e))), 
+                                _mm_cvtps_pd(_mm_movehl_ps(l, l)));
+                _mm_storeu_pd(acc + i, lo);
+                _mm_storeu_pd(acc + i + 2, hi);
+                __m128 avg = _mm_movelh_ps(_mm_cvtpd_ps(_mm_mul_pd(lo, inv)), 
+                                           _mm_cvtpd_ps(_mm_mul_pd(hi, inv)));
+                _mm_storeu_ps(out + i, avg);
+            }
+            for (; i < count; ++i){
+                acc[i] += enter[i];
+                acc[i] -= leave[i];
+                out[i] = BlurAccumulator<float>::Average(acc[i], window);
+            }
+        }
+
+        inline void BlurColumns(const unsigned char* enter, const unsigned char* leave, 
+                                unsigned int* acc, unsigned char* out, int count, int window){
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 inv = _mm_set1_ps(1.0f / window);
+            const __m128 half = _mm_set1_ps(0.5f);
+            int i = 0;
+            for (; i + 16 <= count; i += 16){
+                __m128i e = _mm_loadu_si128((const __m128i*)(enter + i));
+                __m128i l = _mm_loadu_si128((const __m128i*)(leave + i));
+                // The difference between the rows fits in 16 bits.
+                __m128i diff[2];
+                diff[0] = _mm_sub_epi16(_mm_unpacklo_epi8(e, zero), _mm_unpacklo_epi8(l, zero));
+                diff[1] = _mm_sub_epi16(_mm_unpackhi_epi8(e, zero), _mm_unpackhi_epi8(l, zero));
+                __m128i avg16[2];
+                for (int h = 0; h < 2; ++h){
+                    __m128i sign = _mm_cmpgt_epi16(zero, diff[h]);
+                    __m128i d32[2];
+                    d32[0] = _mm_unpacklo_epi16(diff[h], sign);
+                    d32[1] = _mm_unpackhi_epi16(diff[h], sign);
+                    __m128i avg32[2];
+                    for (int q = 0; q < 2; ++q){
+                        __m128i* a = (__m128i*)(acc + i + h * 8 + q * 4);
+                        __m128i sum = _mm_add_epi32(_mm_loadu_si128(a), d32[q]);
+                        _mm_storeu_si128(a, sum);
+                        __m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), inv), half);
+                        avg32[q] = _mm_cvttps_epi32(f);
                     }
+                    avg16[h] = _mm_packs_epi32(avg32[0], avg32[1]);
                 }
+                _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(avg16[0], avg16[1]));
+            }
+            for (; i < count; ++i){
+                acc[i] += enter[i];
+                acc[i] -= leave[i];
+                out[i] = BlurAccumulator<unsigned char>::Average(acc[i], window);
             }
+        }
+#endif
 
-            for (unsigned int x = 0; x < width; ++x){
-                for (unsigned int y = 0; y < height; ++y){
-                    T* pixel = tex->GetPixel(x, y);
-                    for (unsigned char c = 0; c < channels; ++c){
-                        pixel[c] = 0;
-                        for (int Y = -halfsize; Y <= halfsize; ++Y){
-                            pixel[c] += temp.GetPixel(x, y + Y)[c];
-                        }
-                        pixel[c] /= (halfsize * 2 + 1);
+        /**
+         * Box bluring. Runs in time O(texSize^2) independent of the
+         * halfsize by sliding the blur window along the rows and
+         * columns, summing in the type given by BlurAccumulator<T>.
+         *
+         * Rows are blurred in parallel, after which the columns are
+         * blurred in parallel strips running down the texture.
+         */
+        template <class T>
+        void BoxBlur(Texture2DPtr(T) tex, int halfsize = 1){
+            typedef typename BlurAccumulator<T>::Type Acc;
+
+            tex->Load();
+            if (halfsize < 1) return;
+
+            const int width = tex->GetWidth();
+            const int height = tex->GetHeight();
+            const int channels = tex->GetChannels();
+            const int rowSize = width * channels;
+            const int window = 2 * halfsize + 1;
+            const Wrapping wrapping = tex->GetWrapping();
+
+            T* data = tex->GetData();
+            T* temp = new T[rowSize * height];
+
+            // Blur the rows into temp
+#pragma omp parallel for
+            for (int y = 0; y < height; ++y){
+                const T* src = data + y * rowSize;
+                T* dst = temp + y * rowSize;
+                for (int c = 0; c < channels; ++c){
+                    Acc acc = 0;
+                    for (int X = -halfsize; X <= halfsize; ++X)
+                        acc += src[WrapTexel(X, width, wrapping) * channels + c];
+                    dst[c] = BlurAccumulator<T>::Average(acc, window);
+                    for (int x = 1; x < width; ++x){
+                        acc += src[WrapTexel(x + halfsize, width, wrapping) * channels + c];
+                        acc -= src[WrapTexel(x - halfsize - 1, width, wrapping) * channels + c];
+                        dst[x * channels + c] = BlurAccumulator<T>::Average(acc, window);
                     }
                 }
             }
+
+            // Blur the columns of temp back into the texture, in
+            // strips of STRIP texel components.
+            const int STRIP = 256;
+            const int strips = (rowSize + STRIP - 1) / STRIP;
+#pragma omp parallel for
+            for (int s = 0; s < strips; ++s){
+                const int start = s * STRIP;
+                const int count = start + STRIP > rowSize ? rowSize - start : STRIP;
+                Acc acc[STRIP];
+                for (int i = 0; i < count; ++i){
+                    acc[i] = 0;
+                    for (int Y = -halfsize; Y <= halfsize; ++Y)
+                        acc[i] += temp[WrapTexel(Y, height, wrapping) * rowSize + start + i];
+                    data[start + i] = BlurAccumulator<T>::Average(acc[i], window);
+                }
+                for (int y = 1; y < height; ++y){
+                    const T* enter = temp + WrapTexel(y + halfsize, height, wrapping) * rowSize + start;
+                    const T* leave = temp + WrapTexel(y - halfsize - 1, height, wrapping) * rowSize + start;
+                    BlurColumns(enter, leave, acc, data + y * rowSize + start, count, window);
+                }
+            }
+
+            delete [] temp;
         }
 
         template <class T>
@@ -13,6 +13,8 @@
 #include <Math/RandomGenerator.h>
 #include <Logging/Logger.h>
 
+#include <algorithm>
+
 using namespace OpenEngine::Scene;
 using namespace OpenEngine::Math;
 
@@ -148,5 +150,125 @@ namespace OpenEngine {
             return tex;
         }
 
+        FloatTexture2DPtr ThermalErosion(FloatTexture2DPtr tex, unsigned int iterations,
+                                         float talus, float rate, float epsilon){
+            tex->Load();
+            return ThermalErosionRect(tex, 0, 0, tex->GetWidth(), tex->GetHeight(),
+                                      iterations, talus, rate, epsilon);
+        }
+
+        /**
+         * http://web.mit.edu/cesium/Public/terrain.pdf
+         *
+         * Musgrave's thermal weathering, formulated as a gather so
+         * each pass can be computed in parallel. The first step
+         * computes how much each texel sheds and how it is
+         * distributed, the second lets every texel collect what its
+         * higher neighbours shed onto it.
+         */
+        FloatTexture2DPtr ThermalErosionRect(FloatTexture2DPtr tex, int x, int z, int w, int d,
+                                             unsigned int iterations, float talus,
+                                             float rate, float epsilon){
+            tex->Load();
+
+            int width = tex->GetWidth();
+            int height = tex->GetHeight();
+            int channels = tex->GetChannels();
+
+            // Clamp the area to the texture
+            int xStart = x < 0 ? 0 : x;
+            int zStart = z < 0 ? 0 : z;
+            int xEnd = x + w > width ? width : x + w;
+            int zEnd = z + d > height ? height : z + d;
+            if (xEnd <= xStart || zEnd <= zStart) return tex;
+            w = xEnd - xStart;
+            d = zEnd - zStart;
+
+            if (rate > 0.5f) rate = 0.5f;
+
+            // The 8 neighbours and the talus scaled by their distance.
+            const int dx[8] = {1, -1, 0, 0, 1, -1, 1, -1};
+            const int dz[8] = {0, 0, 1, -1, 1, 1, -1, -1};
+            float slope[8];
+            for (int n = 0; n < 8; ++n)
+                slope[n] = n < 4 ? talus : talus * sqrt(2.0f);
+
+            float* front = new float[w * d];
+            float* back = new float[w * d];
+            float* shed = new float[w * d]; // height shed pr. unit excess
+            float* rowMax = new float[d];
+
+            float* data = tex->GetData();
+            for (int j = 0; j < d; ++j)
+                for (int i = 0; i < w; ++i)
+                    front[i + j * w] = data[((xStart + i) + (zStart + j) * width) * channels];
+
+            for (unsigned int it = 0; it < iterations; ++it){
+                // Compute the amount shed by each texel
+#pragma omp parallel for
+                for (int j = 0; j < d; ++j){
+                    float moved = 0.0f;
+                    for (int i = 0; i < w; ++i){
+                        float h = front[i + j * w];
+                        float total = 0.0f, largest = 0.0f;
+                        for (int n = 0; n < 8; ++n){
+                            int ni = i + dx[n], nj = j + dz[n];
+                            if (ni < 0 || ni >= w || nj < 0 || nj >= d) continue;
+                            float excess = h - front[ni + nj * w] - slope[n];
+                            if (excess > 0.0f){
+                                total += excess;
+                                largest = excess > largest ? excess : largest;
+                            }
+                        }
+                        float amount = rate * largest;
+                        shed[i + j * w] = total > 0.0f ? amount / total : 0.0f;
+                        moved = amount > moved ? amount : moved;
+                    }
+                    rowMax[j] = moved;
+                }
+
+                float maxMoved = 0.0f;
+                for (int j = 0; j < d; ++j)
+                    maxMoved = rowMax[j] > maxMoved ? rowMax[j] : maxMoved;
+                if (maxMoved < epsilon) break;
+
+                // Gather the material shed onto each texel
+#pragma omp parallel for
+                for (int j = 0; j < d; ++j){
+                    for (int i = 0; i < w; ++i){
+                        float h = front[i + j * w];
+                        float result = h;
+                        for (int n = 0; n < 8; ++n){
+                            int ni = i + dx[n], nj = j + dz[n];
+                            if (ni < 0 || ni >= w || nj < 0 || nj >= d) continue;
+                            float nh = front[ni + nj * w];
+                            // Material leaving towards the neighbour
+                            float excess = h - nh - slope[n];
+                            if (excess > 0.0f)
+                                result -= shed[i + j * w] * excess;
+                            // Material arriving from the neighbour
+                            excess = nh - h - slope[n];
+                            if (excess > 0.0f)
+                                result += shed[ni + nj * w] * excess;
+                        }
+                        back[i + j * w] = result;
+                    }
+                }
+
+                std::swap(front, back);
+            }
+
+            for (int j = 0; j < d; ++j)
+                for (int i = 0; i < w; ++i)
+                    data[((xStart + i) + (zStart + j) * width) * channels] = front[i + j * w];
+
+            delete [] front;
+            delete [] back;
+            delete [] shed;
+            delete [] rowMax;
+
+            return tex;
+        }
+
     }
 }
@@ -43,7 +43,36 @@ namespace OpenEngine {
         FloatTexture2DPtr CreateBubble(FloatTexture2DPtr tex, 
                                        Math::Vector<2, int> center,
                                        int radius = 10, float disp = 5);
-        
+
+        /**
+         * Thermal erosion. Material on slopes steeper than the talus
+         * height difference pr. texel slides down to the lower
+         * neighbours, wearing down the cliffs left by fx MakePlateau
+         * and CreateBubble.
+         *
+         * Each pass reads from one buffer and writes to another, so
+         * the texels are updated in parallel. Stops after the given
+         * number of iterations or when no texel moves more than
+         * epsilon.
+         *
+         * @param talus The largest stable height difference between
+         * two neighbouring texels.
+         * @param rate The fraction of the excess height moved each
+         * pass. Must be in ]0, 0.5] to be stable.
+         */
+        FloatTexture2DPtr ThermalErosion(FloatTexture2DPtr tex, unsigned int iterations = 50,
+                                         float talus = 1.0f, float rate = 0.5f, float epsilon = 0.001f);
+
+        /**
+         * Thermal erosion restricted to the rectangle starting at (x,
+         * z) with the given width and depth. Texels outside the
+         * rectangle are left untouched and do not exchange material
+         * with the inside, so the total height is preserved.
+         */
+        FloatTexture2DPtr ThermalErosionRect(FloatTexture2DPtr tex, int x, int z, int width, int depth,
+                                             unsigned int iterations = 50, float talus = 1.0f,
+                                             float rate = 0.5f, float epsilon = 0.001f);
+
     }
 }
 